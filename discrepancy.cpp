@@ -26,6 +26,7 @@
 #include <iostream>
 #include <chrono>
 #include "discrepancy.h"
+#include "exactdisc.h"
 #include "quadlods.h"
 #include "random.h"
 #include "threads.h"
@@ -35,9 +36,7 @@ using namespace std;
 using namespace quadlods;
 namespace cr=std::chrono;
 
-vector<Box> emptyPop;
 vector<Box> population;
-BoxCountBlock boxCountBlock;
 double flowerDisc[2]={0,1};
 /* When computing the discrepancy of a flower plot, these changes apply:
  * • This array is set to {-1,1}.
@@ -181,25 +180,36 @@ int Box::in(const vector<double> &point)
   return ret;
 }
 
-void Box::countPoints(const vector<vector<double> > &points)
+void Box::countPoints(const PointTree &tree)
 {
-  int i,ptin;
+  int i;
+  array<int,2> count;
+  if (tree.dimensions()!=bounds.size())
+    throw sizeMismatch;
   volume=1;
   if (flowerDisc[0])
     volume=areaInCircle(bounds[0][0],bounds[1][0],bounds[0][1],bounds[1][1])/M_PI;
   else
     for (i=0;i<bounds.size();i++)
       volume*=bounds[i][1]-bounds[i][0];
-  pointsIn=pointsBound=0;
-  pointsTotal=points.size();
-  for (i=0;i<points.size();i++)
-  {
-    ptin=in(points[i]);
-    if (ptin==1)
-      pointsBound++;
-    if (ptin==2)
-      pointsIn++;
-  }
+  count=tree.count(bounds);
+  pointsIn=count[0];
+  pointsBound=count[1];
+  pointsTotal=tree.size();
+}
+
+void Box::countMorePoints(const PointTree &tree)
+/* Adds the points in tree, which are the ones after the pointsTotal points
+ * already counted, to the counts. The bounds must not have changed since.
+ */
+{
+  array<int,2> count;
+  if (tree.dimensions()!=bounds.size())
+    throw sizeMismatch;
+  count=tree.count(bounds);
+  pointsIn+=count[0];
+  pointsBound+=count[1];
+  pointsTotal+=tree.size();
 }
 
 double Box::discrepancy()
@@ -218,9 +228,10 @@ double Box::discrepancy()
 
 void Box::mutate(const std::vector<std::vector<double> > &points,int pntnum,int coord)
 /* Replaces one of the bounds, at random, with the corresponding coordinate
- * of one of the points, at random.
+ * of one of the points, at random. The counts are no longer valid.
  */
 {
+  pointsIn=pointsBound=pointsTotal=0;
   if (pntnum<0)
     pntnum=rng.rangerandom(points.size()+2);
   if (coord<0)
@@ -248,52 +259,6 @@ bool operator==(const Box &l,const Box &r)
   return ret;
 }
 
-BoxCountBlock::BoxCountBlock()
-{
-  pop=&emptyPop;
-  pts=nullptr;
-  b=e=left=0;
-}
-
-void BoxCountBlock::load(vector<Box> &population,int begin,int end,const vector<vector<double> > &points)
-{
-  mtx.lock();
-  pop=&population;
-  b=begin;
-  e=end;
-  left=e-b;
-  pts=&points;
-  mtx.unlock();
-}
-
-BoxCountItem BoxCountBlock::getItem()
-{
-  BoxCountItem ret{&(*pop)[b],*pts};
-  mtx.lock();
-  if (b<e)
-    ret.box=&(*pop)[b++];
-  else
-    ret.box=nullptr;
-  mtx.unlock();
-  return ret;
-}
-
-void BoxCountBlock::countFinished()
-{
-  mtx.lock();
-  left--;
-  mtx.unlock();
-}
-
-bool BoxCountBlock::done()
-{
-  bool ret;
-  mtx.lock();
-  ret=left==0 && b==e;
-  mtx.unlock();
-  return ret;
-}
-
 void sort(vector<Box> &pop,int begin,int end,int popLimit)
 /* Quicksort, but with some recursion omitted.
  * If begin=0 or popLimit is in the interval, sort; else don't bother.
@@ -356,23 +321,59 @@ double prog(int nsteady,int niter)
   return ((double)endpt-nsteady)/(endpt+0.5);
 }
 
+void countBoxes(vector<Box> &pop,int begin,int end,const PointTree &tree,const PointTree &newTree,DotBaton &dotbaton,double progress)
+/* Counts the points in boxes begin through end-1 of pop on the thread pool,
+ * in blocks of boxes big enough to be worth a task, updating dotbaton with
+ * progress while waiting. tree has all the points and newTree the ones
+ * added since the last call; a box kept from the last call counts only those.
+ * If there are none, newTree is empty and the kept boxes are already counted.
+ */
+{
+  int i,grain=256;
+  TaskGroup group;
+  auto count=[&pop,&tree,&newTree,end,grain](int first)
+  {
+    int i,total;
+    for (i=first;i<end && i<first+grain;i++)
+    {
+      total=pop[i].getPointsTotal();
+      if (total!=tree.size())
+	if (total && total+newTree.size()==tree.size())
+	  pop[i].countMorePoints(newTree);
+	else
+	  pop[i].countPoints(tree);
+    }
+  };
+  for (i=begin;i<end;i+=grain)
+    group.run([count,i](){count(i);});
+  while (!group.waitFor(cr::milliseconds(1)))
+    dotbaton.update(progress,group.pending()*grain);
+}
+
 double discrepancy(const vector<vector<double> > &points,bool keepPop)
 /* Computes the discrepancy (or a lower bound) of the points. keepPop is for
  * incrementally computing the discrepancy of a long list of points. The next
  * call will assume that all points up to Box::pointsTotal are the same as
- * in this call.
+ * in this call. If the exact discrepancy is cheap enough to compute, it is
+ * computed instead, leaving the population alone.
  */
 {
   vector<int> delenda;
   DotBaton dotbaton;
+  PointTree tree(points),newTree;
   mpq_class mutationRate(1,points[0].size());
   double lastdisc=-1;
-  int i,j,prevsz=0,sz,dim,nParents,popLimit,niter=0,nsteady=0;
+  int i,j,prevsz=0,sz,dim,nParents,nSeeds,popLimit,niter=0,nsteady=0;
+  double ret;
   vector<double> all0,all1;
   cr::nanoseconds elapsed;
   cr::time_point<cr::steady_clock> timeStart;
+  if (exactWork(points.size(),points[0].size())<=EXACT_WORK)
+    return exactDiscrepancy(points);
   if (population.size())
     prevsz=population[0].getPointsTotal();
+  if (prevsz)
+    newTree=PointTree(points,prevsz);
   sz=points.size();
   dim=points[0].size();
   popLimit=3*dim*sz+8192;
@@ -381,26 +382,25 @@ double discrepancy(const vector<vector<double> > &points,bool keepPop)
     all0.push_back(flowerDisc[0]);
     all1.push_back(flowerDisc[1]);
   }
-  for (i=0;i<sz;i++)
+  /* The boxes kept from the last call already have the old points counted,
+   * so the population is seeded only from the points added since.
+   */
+  for (i=prevsz;i<sz;i++)
     population.push_back(Box(points[i],points[(i+1)%sz]));
   population.push_back(Box(all0,all1));
-  for (i=0;i<sz*2;i++)
-    population.push_back(Box(points[i%sz],points[rng.rangerandom(sz)]));
-  for (i=0;i<sz;i++)
+  for (i=0;i<(sz-prevsz)*2;i++)
+    population.push_back(Box(points[prevsz+i%(sz-prevsz)],points[rng.rangerandom(sz)]));
+  nSeeds=population.size();
+  for (i=prevsz;i<sz;i++)
     for (j=0;j<dim;j++)
     {
       if (prevsz)
-	population.push_back(population[rng.rangerandom(prevsz)]);
+	population.push_back(population[rng.rangerandom(nSeeds)]);
       else
 	population.push_back(Box(all0,all1));
       population.back().mutate(points,i,j);
     }
-  boxCountBlock.load(population,0,population.size(),points);
-  while (!boxCountBlock.done())
-  {
-    this_thread::sleep_for(chrono::milliseconds(1));
-    dotbaton.update(1e-7,boxCountBlock.getLeft());
-  }
+  countBoxes(population,0,population.size(),tree,newTree,dotbaton,1e-7);
   while (prog(nsteady,niter) || population.size()<popLimit)
   {
     timeStart=clk.now();
@@ -414,12 +414,7 @@ double discrepancy(const vector<vector<double> > &points,bool keepPop)
     elapsed=clk.now()-timeStart;
     //cout<<"Breeding took "<<elapsed.count()/1e6<<" ms\n";
     timeStart=clk.now();
-    boxCountBlock.load(population,nParents,population.size(),points);
-    while (!boxCountBlock.done())
-    {
-      this_thread::sleep_for(chrono::milliseconds(1));
-      dotbaton.update(prog(nsteady,niter),boxCountBlock.getLeft());
-    }
+    countBoxes(population,nParents,population.size(),tree,newTree,dotbaton,prog(nsteady,niter));
     elapsed=clk.now()-timeStart;
     //cout<<population.size()-nParents<<" new boxes took "<<elapsed.count()/1e6<<" ms\n";
     sort(population,0,population.size(),popLimit);
@@ -446,20 +441,10 @@ double discrepancy(const vector<vector<double> > &points,bool keepPop)
   dotbaton.update(0,0);
   for (i=0;i>3 && i<population.size();i++)
     population[i].dump();
+  ret=fabs(population[0].discrepancy());
   if (keepPop)
     population.resize(3);
   else
     population.clear();
-  return fabs(population[0].discrepancy());
-}
-
-bool countAnyBlock()
-{
-  BoxCountItem item=boxCountBlock.getItem();
-  if (item.box)
-  {
-    item.box->countPoints(item.points);
-    boxCountBlock.countFinished();
-  }
-  return item.box!=nullptr;
+  return ret;
 }
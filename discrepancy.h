@@ -24,13 +24,16 @@
 #include <vector>
 #include <array>
 #include "threads.h"
+#include "pointtree.h"
 /* This computes the discrepancy using a genetic algorithm like that invented
  * by Manan Shah. Each individual is a box; its fitness is its discrepancy.
  * In each generation, the least fit boxes die, and the remaining boxes have
- * children, with occasional mutations.
+ * children, with occasional mutations. In one, two, or three dimensions,
+ * if there are few enough points, it is instead computed exactly.
  */
 #define sizeMismatch 1
 
+extern double flowerDisc[2];
 double areaInCircle(double minx,double miny,double maxx,double maxy);
 void setFlowerDisc(bool fd);
 
@@ -41,7 +44,8 @@ public:
   Box(std::vector<double> pnt0,std::vector<double> pnt1);
   Box(Box &mother,Box &father);
   int in(const std::vector<double> &point);
-  void countPoints(const std::vector<std::vector<double> > &points);
+  void countPoints(const PointTree &tree);
+  void countMorePoints(const PointTree &tree);
   double discrepancy();
   int getPointsTotal()
   {
@@ -56,31 +60,5 @@ private:
   int pointsIn,pointsBound,pointsTotal;
 };
 
-struct BoxCountItem
-{
-  Box *box;
-  const std::vector<std::vector<double> > &points;
-};
-
-class BoxCountBlock
-{
-public:
-  BoxCountBlock();
-  void load(std::vector<Box> &population,int begin,int end,const std::vector<std::vector<double> > &points);
-  BoxCountItem getItem();
-  void countFinished();
-  bool done();
-  int getLeft()
-  {
-    return left;
-  }
-private:
-  std::vector<Box> *pop;
-  int b,e,left;
-  const std::vector<std::vector<double> > *pts;
-  std::mutex mtx;
-};
-
 double discrepancy(const std::vector<std::vector<double> > &points,bool keepPop=false);
-
-bool countAnyBlock();
+extern std::vector<Box> population; // kept between calls if keepPop
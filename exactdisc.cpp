@@ -0,0 +1,324 @@
+/******************************************************/
+/*                                                    */
+/* exactdisc.cpp - exact discrepancy in 1 to 3 dims   */
+/*                                                    */
+/******************************************************/
+/* Copyright 2026 Pierre Abbat.
+ * This file is part of the Quadlods program.
+ * 
+ * The Quadlods program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Quadlods is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Quadlods. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include "exactdisc.h"
+#include "discrepancy.h"
+#include "threads.h"
+#include "dotbaton.h"
+
+using namespace std;
+namespace cr=std::chrono;
+
+RectSweep::RectSweep(const vector<array<double,2> > &pts,int total,double scale,bool closed,bool flower)
+/* An open rectangle can have sides on the boundary of the domain, so
+ * the boundary is added to the coordinates.
+ */
+{
+  int i,nx;
+  vector<int> order,pos;
+  TaskGroup group;
+  npoints=pts.size();
+  this->total=total;
+  this->scale=scale;
+  this->closed=closed;
+  this->flower=flower;
+  for (i=0;i<npoints;i++)
+  {
+    xval.push_back(pts[i][0]);
+    yval.push_back(pts[i][1]);
+    order.push_back(i);
+  }
+  if (!closed)
+    for (i=0;i<2;i++)
+    {
+      xval.push_back(flowerDisc[i]);
+      yval.push_back(flowerDisc[i]);
+    }
+  sort(xval.begin(),xval.end());
+  xval.erase(unique(xval.begin(),xval.end()),xval.end());
+  sort(yval.begin(),yval.end());
+  yval.erase(unique(yval.begin(),yval.end()),yval.end());
+  sort(order.begin(),order.end(),[&pts](int a,int b){return pts[a]<pts[b];});
+  for (i=0;i<npoints;i++)
+  {
+    xi.push_back(lower_bound(xval.begin(),xval.end(),pts[order[i]][0])-xval.begin());
+    yi.push_back(lower_bound(yval.begin(),yval.end(),pts[order[i]][1])-yval.begin());
+  }
+  levelStart.assign(yval.size()+1,0);
+  for (i=0;i<npoints;i++)
+    levelStart[yi[i]+1]++;
+  for (i=0;i<yval.size();i++)
+    levelStart[i+1]+=levelStart[i];
+  pos=levelStart;
+  byY.resize(npoints);
+  for (i=0;i<npoints;i++)
+    byY[pos[yi[i]]++]=i;
+  if (flower)
+  {
+    nx=xval.size();
+    area.resize(yval.size()*nx);
+    for (i=0;i<yval.size();i++)
+      group.run([this,i,nx]()
+		{
+		  int k;
+		  for (k=0;k<nx;k++)
+		    area[i*nx+k]=areaInCircle(flowerDisc[0],flowerDisc[0],xval[k],yval[i])/M_PI;
+		});
+    group.wait();
+  }
+}
+
+double RectSweep::volume(int x,int a,int b) const
+// Returns the scaled area left of xval[x] between yval[a] and yval[b].
+{
+  if (flower)
+    return scale*(area[b*xval.size()+x]-area[a*xval.size()+x]);
+  else
+    return scale*(xval[x]-xval[0])*(yval[b]-yval[a]);
+}
+
+double RectSweep::scan(const vector<int> &next,int a,int b) const
+/* Walks the points in the list, which are those between yval[a] and yval[b],
+ * in order of x. The best rectangle ending at a value of x is found by
+ * keeping the best start so far.
+ */
+{
+  int p=next[npoints],x,cnt=0;
+  double inv=1./total,ret=0,v,start;
+  if (closed)
+  {
+    start=INFINITY;
+    while (p<npoints)
+    {
+      x=xi[p];
+      v=volume(x,a,b);
+      start=min(start,cnt*inv-v);
+      for (;p<npoints && xi[p]==x;p=next[p])
+	cnt++;
+      ret=max(ret,cnt*inv-v-start);
+    }
+  }
+  else
+  {
+    start=volume(0,a,b);
+    while (p<npoints)
+    {
+      x=xi[p];
+      v=volume(x,a,b);
+      ret=max(ret,v-cnt*inv-start);
+      for (;p<npoints && xi[p]==x;p=next[p])
+	cnt++;
+      start=min(start,v-cnt*inv);
+    }
+    ret=max(ret,volume(xval.size()-1,a,b)-cnt*inv-start);
+  }
+  return ret;
+}
+
+double RectSweep::sweep(int a) const
+/* The points above the bottom go in a linked list in order of x. The top
+ * starts at the highest level and moves down, dropping the points that
+ * are no longer inside from the list.
+ */
+{
+  int i,p,b,lvl,last=npoints,top=yval.size()-1;
+  vector<int> next(npoints+1),prev(npoints+1);
+  double ret=0;
+  for (p=0;p<npoints;p++)
+    if (closed?(yi[p]>=a):(yi[p]>a && yi[p]<top))
+    {
+      next[last]=p;
+      prev[p]=last;
+      last=p;
+    }
+  next[last]=npoints;
+  prev[npoints]=last;
+  for (b=top;b>=a+!closed;b--)
+  {
+    ret=max(ret,scan(next,a,b));
+    lvl=closed?b:b-1;
+    if (lvl>a)
+      for (i=levelStart[lvl];i<levelStart[lvl+1];i++)
+      {
+	p=byY[i];
+	next[prev[p]]=next[p];
+	prev[next[p]]=prev[p];
+      }
+  }
+  return ret;
+}
+
+double RectSweep::best() const
+{
+  int a;
+  double ret=0;
+  for (a=0;a<yval.size();a++)
+    ret=max(ret,sweep(a));
+  return ret;
+}
+
+double exactWork(int n,int dim)
+/* Estimates the number of steps of the inner loop in computing the
+ * discrepancy of n points exactly.
+ */
+{
+  if (flowerDisc[0] && dim!=2)
+    return INFINITY;
+  switch (dim)
+  {
+    case 1:
+      return n*log2(n+1.);
+    case 2:
+      return pow(n,3)/3;
+    case 3:
+      return pow(n,5)/60;
+    default:
+      return INFINITY;
+  }
+}
+
+double maxOfTasks(int ntasks,const function<double(int)> &task)
+/* Runs task(0) through task(ntasks-1) on the thread pool, showing progress,
+ * and returns the largest result.
+ */
+{
+  int i;
+  double ret=0;
+  vector<double> result(ntasks,0);
+  DotBaton dotbaton;
+  TaskGroup group;
+  for (i=0;i<ntasks;i++)
+    group.run([&task,&result,i](){result[i]=task(i);});
+  while (!group.waitFor(cr::milliseconds(1)))
+    dotbaton.update((double)group.pending()/ntasks,group.pending());
+  dotbaton.update(0,0);
+  for (i=0;i<ntasks;i++)
+    ret=max(ret,result[i]);
+  return ret;
+}
+
+double discrepancy1(const vector<vector<double> > &points)
+/* The boxes are intervals. The scan is the same as RectSweep::scan
+ * with all points in one level.
+ */
+{
+  int i,j,n=points.size();
+  vector<double> xs;
+  double over=0,under=0,start;
+  for (i=0;i<n;i++)
+    xs.push_back(points[i][0]);
+  sort(xs.begin(),xs.end());
+  start=INFINITY;
+  for (i=0;i<n;i=j)
+  {
+    for (j=i;j<n && xs[j]==xs[i];j++);
+    start=min(start,(double)i/n-xs[i]);
+    over=max(over,(double)j/n-xs[i]-start);
+  }
+  start=flowerDisc[0];
+  for (i=0;i<n;i=j)
+  {
+    for (j=i;j<n && xs[j]==xs[i];j++);
+    under=max(under,xs[i]-(double)i/n-start);
+    start=min(start,xs[i]-(double)j/n);
+  }
+  under=max(under,flowerDisc[1]-1-start);
+  return max(over,under);
+}
+
+double discrepancy2(const vector<vector<double> > &points)
+{
+  int i,n=points.size();
+  vector<array<double,2> > pts;
+  for (i=0;i<n;i++)
+    pts.push_back(array<double,2>{points[i][0],points[i][1]});
+  RectSweep over(pts,n,1,true,flowerDisc[0]!=0);
+  RectSweep under(pts,n,1,false,flowerDisc[0]!=0);
+  return maxOfTasks(over.levels()+under.levels(),[&over,&under](int a)
+		    {
+		      if (a<over.levels())
+			return over.sweep(a);
+		      else
+			return under.sweep(a-over.levels());
+		    });
+}
+
+double discrepancy3(const vector<vector<double> > &points)
+/* Each slab between two levels of z is a two-dimensional problem whose
+ * areas are multiplied by the height of the slab. The points are sorted
+ * by z, so the points in a slab are contiguous.
+ */
+{
+  int i,n=points.size();
+  vector<vector<double> > byZ(points);
+  vector<double> zval;
+  for (i=0;i<n;i++)
+    zval.push_back(points[i][2]);
+  zval.push_back(flowerDisc[0]);
+  zval.push_back(flowerDisc[1]);
+  sort(zval.begin(),zval.end());
+  zval.erase(unique(zval.begin(),zval.end()),zval.end());
+  sort(byZ.begin(),byZ.end(),[](const vector<double> &a,const vector<double> &b){return a[2]<b[2];});
+  auto zbound=[&byZ](double z,bool above)
+  // Returns the index of the first point whose z is above, or at least, z.
+  {
+    return (above?upper_bound(byZ.begin(),byZ.end(),z,[](double z,const vector<double> &p){return z<p[2];})
+		 :lower_bound(byZ.begin(),byZ.end(),z,[](const vector<double> &p,double z){return p[2]<z;}))-byZ.begin();
+  };
+  return maxOfTasks(2*zval.size(),[&](int t)
+		    {
+		      int a=t/2,b,i,begin,end;
+		      bool closed=t&1;
+		      double ret=0;
+		      vector<array<double,2> > pts;
+		      for (b=a+!closed;b<zval.size();b++)
+		      {
+			begin=zbound(zval[a],!closed);
+			end=zbound(zval[b],closed);
+			pts.clear();
+			for (i=begin;i<end;i++)
+			  pts.push_back(array<double,2>{byZ[i][0],byZ[i][1]});
+			ret=max(ret,RectSweep(pts,n,zval[b]-zval[a],closed,false).best());
+		      }
+		      return ret;
+		    });
+}
+
+double exactDiscrepancy(const vector<vector<double> > &points)
+{
+  switch (points.size()?points[0].size():0)
+  {
+    case 1:
+      return discrepancy1(points);
+    case 2:
+      return discrepancy2(points);
+    case 3:
+      return discrepancy3(points);
+    default:
+      return NAN;
+  }
+}
@@ -0,0 +1,76 @@
+/******************************************************/
+/*                                                    */
+/* exactdisc.h - exact discrepancy in few dimensions  */
+/*                                                    */
+/******************************************************/
+/* Copyright 2026 Pierre Abbat.
+ * This file is part of the Quadlods program.
+ * 
+ * The Quadlods program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Quadlods is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Quadlods. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EXACTDISC_H
+#define EXACTDISC_H
+
+#include <vector>
+#include <array>
+
+/* The discrepancy computed by the genetic algorithm is the largest, over
+ * all boxes, of the difference between the fraction of points in the box
+ * and its volume. The most overfull box is closed and has every side
+ * through a point; the most underfull box is open and has every side
+ * through a point or on the boundary of the domain. In one, two, or three
+ * dimensions, there are few enough such boxes to try them all. A box's
+ * bottom and top are fixed, and a sweep along x finds the best left and
+ * right sides of all boxes with that bottom and top at once.
+ */
+
+// Largest number of steps for which discrepancy() computes exactly.
+#define EXACT_WORK 4e9
+
+class RectSweep
+/* Finds the most overfull (if closed) or underfull (if open) rectangle
+ * for a set of points in the plane, out of a total number of points.
+ * Areas are multiplied by scale, which is the height of the slab in
+ * three dimensions. In a flower plot, areas are clipped to the unit
+ * circle and divided by π.
+ */
+{
+public:
+  RectSweep(const std::vector<std::array<double,2> > &pts,int total,double scale,bool closed,bool flower);
+  int levels()
+  {
+    return yval.size();
+  }
+  double sweep(int a) const;
+  // Returns the largest excess of rectangles whose bottom is at yval[a].
+  double best() const;
+private:
+  int npoints,total;
+  double scale;
+  bool closed,flower;
+  std::vector<double> xval,yval; // distinct, sorted
+  std::vector<int> xi,yi; // indices of points, sorted by x, into xval and yval
+  std::vector<int> byY; // points sorted by y
+  std::vector<int> levelStart; // index in byY of first point at each level
+  std::vector<double> area; // in a flower plot, below yval[l] and left of xval[k]
+  double volume(int x,int a,int b) const;
+  double scan(const std::vector<int> &next,int a,int b) const;
+};
+
+double exactWork(int n,int dim);
+double exactDiscrepancy(const std::vector<std::vector<double> > &points);
+#endif
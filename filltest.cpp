@@ -22,6 +22,7 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#include <array>
 #include <cassert>
 #include "filltest.h"
 #include "hstep.h"
@@ -135,6 +136,7 @@ void filltest(Quadlods &quad,int iters,PostScript &ps)
   for (i=0;i<sz;i++)
     for (l=0;l<3;l++)
       closedist[l].push_back(sz);
+  point.resize(sz);
   ps.setpaper(a4land,0);
   ps.prolog();
   for (i=0;i<=iters;i++)
@@ -146,7 +148,7 @@ void filltest(Quadlods &quad,int iters,PostScript &ps)
       cout.flush();
       then=now;
     }
-    point=quad.dgen();
+    quad.dgenBatch(1,&point[0]);
     for (l=0;l<3;l++)
       for (j=0;j<sz;j++)
       {
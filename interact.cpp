@@ -130,10 +130,9 @@ void cmdInit(string command)
   {
     try
     {
-      quads[n].init(s,res);
+      quads[n].init(s,res,scram);
       if (formats[n]==0)
 	formats[n]=10;
-      quads[n].setscramble(scram);
     }
     catch (...)
     {
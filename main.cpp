@@ -29,6 +29,8 @@
 #include <ctime>
 #include <cassert>
 #include <cmath>
+#include <cstring>
+#include <filesystem>
 #include <boost/program_options.hpp>
 #include "main.h"
 #include "config.h"
@@ -49,6 +51,7 @@
 #include "matrix.h"
 #include "interact.h"
 #include "discrepancy.h"
+#include "exactdisc.h"
 
 #define tassert(x) testfail|=(!(x))
 
@@ -163,12 +166,34 @@ void testContinuedFraction()
 
 void testReverseScramble()
 {
-  int i,j;
+  int i,j,k;
+  Quadlods stored,computed;
+  vector<int> bigPrimes;
   cout<<"Reverse scramble unit test\n";
   fillReverseScrambleTable(5,QL_SCRAMBLE_NONE);
   fillReverseScrambleTable(5,QL_SCRAMBLE_POWER);
+  fillReverseScrambleTable(5,QL_SCRAMBLE_GRAY);
   tassert(reverseScrambleTable[(QL_SCRAMBLE_NONE<<16)+5][10646]==5638);
   tassert(reverseScrambleTable[(QL_SCRAMBLE_POWER<<16)+5][10646]==5642);
+  // The identity is the same for all four non-Halton scramble types.
+  tassert(reverseScrambleTable[(QL_SCRAMBLE_NONE<<16)+5]==reverseScrambleTable[(QL_SCRAMBLE_GRAY<<16)+5]);
+  bigPrimes.push_back(263);
+  bigPrimes.push_back(4099);
+  bigPrimes.push_back(65521);
+  for (k=QL_SCRAMBLE_POWER;k<=QL_SCRAMBLE_FAURE;k++)
+  {
+    stored.init(bigPrimes,0,k);
+    setComputeScramble(true);
+    computed.init(bigPrimes,0,k);
+    setComputeScramble(false);
+    for (i=0;i<1000;i++)
+    {
+      tassert(stored.readout()==computed.readout());
+      tassert(stored.dreadout()==computed.dreadout());
+      stored.advance(65537);
+      computed.advance(65537);
+    }
+  }
   for (i=2;i<12;i++)
   {
     for (j=0;j<i;j++)
@@ -934,7 +959,7 @@ void testHaltonAccumulator()
 {
   vector<unsigned short> terHacc,quinHacc,septHacc;
   int i;
-  mpz_class inc;
+  mpz_class inc,big,before;
   bool sign=false,newsign;
   cout<<"Halton accumulator test\n";
   newsign=incHacc(terHacc,59049,496125,0,sign);
@@ -971,6 +996,547 @@ void testHaltonAccumulator()
   tassert(septHacc[0]==4036);
   tassert(septHacc.size()==16);
   tassert(septHacc.back()==551);
+  // An increment too big for a double is converted exactly.
+  sign=newsign;
+  before=haccValue(terHacc,59049,sign);
+  for (big=1,i=0;i<1500;i++)
+    big*=7;
+  newsign=incHacc(terHacc,59049,big,sign);
+  tassert(!newsign);
+  tassert(haccValue(terHacc,59049,newsign)==before+big);
+  sign=newsign;
+  newsign=incHacc(terHacc,59049,-2*big,sign);
+  tassert(newsign);
+  tassert(haccValue(terHacc,59049,newsign)==before-big);
+}
+
+void testFixedWidth()
+/* Checks the fixed-width Richtmyer engine, which both dgen and readout
+ * use, against scrambling the accumulator as an mpz_class, which pointAt
+ * with an mpz_class index does, for every width and every scramble that
+ * applies to Richtmyer.
+ */
+{
+  int i,j,k,r;
+  double res[]={1e17,1e30,1e60,1e90};
+  int limbs[]={1,2,4,0};
+  vector<double> dpoint;
+  vector<mpq_class> qpoint,opoint;
+  cout<<"Fixed-width test\n";
+  for (r=0;r<4;r++)
+    for (k=QL_SCRAMBLE_NONE;k<=QL_SCRAMBLE_GRAY;k++)
+    {
+      quads[0].init(0,res[r]);
+      quads[0].init(7,res[r]);
+      quads[0].setscramble(k);
+      tassert(quads[0].getlimbs()==limbs[r]);
+      quads[0].advance(-3);
+      for (i=0;i<1000;i++)
+      {
+	dpoint=quads[0].dgen();
+	qpoint=quads[0].readout();
+	quads[0].pointAt(mpz_class(0),opoint);
+	for (j=0;j<dpoint.size();j++)
+	{
+	  tassert(qpoint[j]==opoint[j]);
+	  tassert(dpoint[j]==opoint[j].get_d());
+	}
+      }
+    }
+}
+
+mpz_class mpzFromUint64(uint64_t n)
+{
+  mpz_class ret;
+  mpz_import(ret.get_mpz_t(),1,-1,8,0,0,&n);
+  return ret;
+}
+
+mpz_class scaledFloor(const mpq_class &x,const mpz_class &m)
+// Returns x*m rounded down, but at most m-1, as the integer readouts do.
+{
+  mpz_class ret=(x.get_num()*m)/x.get_den();
+  if (ret>=m)
+    ret=m-1;
+  return ret;
+}
+
+void testIntegerReadout()
+/* Checks the fixed-point, [0,m), and numerator/denominator readouts
+ * against readout, for every width of Richtmyer and for Halton.
+ */
+{
+  int i,j,k,r;
+  double res[]={1e17,1e30,1e60,1e90,0};
+  int scrambles[]={QL_SCRAMBLE_NONE,QL_SCRAMBLE_GRAY,QL_SCRAMBLE_TIPWITCH};
+  uint64_t mods[]={1,1000003,0xffffffffffffffc5};
+  mpz_class two32=mpz_class(1)<<32,two64=mpz_class(1)<<64;
+  vector<mpq_class> qpoint;
+  vector<uint32_t> point32;
+  vector<uint64_t> point64,pointMod;
+  vector<mpz_class> num,denom;
+  mpq_class pair;
+  cout<<"Integer readout test\n";
+  for (r=0;r<5;r++)
+    for (k=0;k<3;k++)
+    {
+      quads[0].init(0,res[r]);
+      quads[0].init(12,res[r],scrambles[k]);
+      quads[0].advance(-3);
+      for (i=0;i<300;i++)
+      {
+	qpoint=quads[0].gen();
+	point32=quads[0].readout32();
+	point64=quads[0].readout64();
+	quads[0].readoutPair(num,denom);
+	for (j=0;j<qpoint.size();j++)
+	{
+	  tassert(point32[j]==scaledFloor(qpoint[j],two32));
+	  tassert(mpzFromUint64(point64[j])==scaledFloor(qpoint[j],two64));
+	  pair=mpq_class(num[j],denom[j]);
+	  pair.canonicalize();
+	  tassert(pair==qpoint[j]);
+	}
+	pointMod=quads[0].readoutMod(mods[i%3]);
+	for (j=0;j<qpoint.size();j++)
+	  tassert(mpzFromUint64(pointMod[j])==scaledFloor(qpoint[j],mpzFromUint64(mods[i%3])));
+      }
+    }
+}
+
+void testHaltonCache()
+/* Checks that the cached Halton readout gives the same doubles as the
+ * exact one, including across -1 to 0 and when changing scrambling, and
+ * likewise the unscrambled readout, which does not use the cache.
+ */
+{
+  int i,j,k;
+  vector<double> dpoint,upoint;
+  vector<mpq_class> qpoint,uqpoint;
+  cout<<"Halton cache test\n";
+  quads[0].init(0,0);
+  quads[0].init(30,0);
+  quads[0].advance(-300);
+  for (k=QL_SCRAMBLE_NONE;k<=QL_SCRAMBLE_TIPWITCH;k++)
+  {
+    quads[0].setscramble(k);
+    for (i=0;i<200;i++)
+    {
+      dpoint=quads[0].dgen();
+      qpoint=quads[0].readout();
+      upoint=quads[0].dreadoutUnscrambled();
+      uqpoint=quads[0].readoutUnscrambled();
+      for (j=0;j<dpoint.size();j++)
+      {
+	tassert(dpoint[j]==qpoint[j].get_d());
+	tassert(upoint[j]==uqpoint[j].get_d());
+      }
+    }
+  }
+}
+
+void testPackedHalton()
+/* Checks that stepping packed Halton accumulators, across many limbs and
+ * through -1 to 0, matches advancing them exactly.
+ */
+{
+  int i,j;
+  mpz_class start;
+  Quadlods stepped,jumped;
+  vector<mpq_class> point;
+  cout<<"Packed Halton test\n";
+  for (j=0;j<2;j++)
+  {
+    if (j)
+      start=(mpz_class(1)<<70)-60;
+    else
+      start=-60;
+    stepped.init(0,0);
+    stepped.init(20,0);
+    stepped.advance(start);
+    for (i=0;i<120;i++)
+    {
+      point=stepped.gen();
+      jumped=Quadlods();
+      jumped.init(0,0);
+      jumped.init(20,0);
+      jumped.advance(start+i+1);
+      tassert(point==jumped.readout());
+    }
+  }
+}
+
+void testStride()
+/* Checks that generators with stride K and offsets 0 through K-1 produce
+ * the same points between them as one generator, for Halton and every
+ * width of Richtmyer, and that a big stride matches advance.
+ */
+{
+  int i,j,k,r;
+  double res[]={1e17,1e30,1e60,1e90,0};
+  const int stride=5;
+  Quadlods serial,worker,big;
+  vector<vector<double> > points;
+  vector<double> bigPoint;
+  cout<<"Stride test\n";
+  for (r=0;r<5;r++)
+  {
+    serial.init(0,res[r]);
+    serial.init(9,res[r]);
+    serial.advance(-7);
+    points.clear();
+    for (i=0;i<200;i++)
+      points.push_back(serial.dgen());
+    serial.advance(-200);
+    for (k=0;k<stride;k++)
+    {
+      worker=serial;
+      worker.setStride(stride,k);
+      tassert(worker.getStride()==stride);
+      for (i=0;i<200/stride;i++)
+	tassert(worker.dgen()==points[i*stride+k]);
+    }
+  }
+  big.init(0,0);
+  big.init(9,0);
+  worker=big;
+  worker.setStride(1000003);
+  big.advance(1);
+  for (i=0;i<20;i++)
+  {
+    bigPoint=worker.dgen();
+    tassert(bigPoint==big.dreadout());
+    big.advance(1000003);
+  }
+}
+
+void testPointAt()
+/* Checks that pointAt and dpointAt give the same tuples as advancing a copy
+ * of the generator, and that they leave the generator alone.
+ */
+{
+  int i,j,k;
+  double res[]={1e17,1e40,1e90,0};
+  mpz_class index[]={0,1,-1,1000,-77777,mpz_class("123456789012345678901")};
+  Quadlods copy;
+  vector<double> dpoint;
+  vector<mpq_class> qpoint,before;
+  cout<<"Point-at-index test\n";
+  for (k=0;k<4;k++)
+  {
+    quads[0].init(0,res[k]);
+    quads[0].init(9,res[k]);
+    quads[0].advance(12345);
+    before=quads[0].readout();
+    for (i=0;i<6;i++)
+    {
+      copy=quads[0];
+      copy.advance(index[i]);
+      quads[0].pointAt(index[i],qpoint);
+      quads[0].dpointAt(index[i],dpoint);
+      tassert(qpoint==copy.readout());
+      for (j=0;j<dpoint.size();j++)
+	tassert(dpoint[j]==qpoint[j].get_d());
+    }
+    tassert(before==quads[0].readout());
+  }
+}
+
+void concurrentGen(int dims,double res,int scram,vector<double> *out)
+{
+  int i;
+  Quadlods q;
+  vector<double> point;
+  q.init(dims,res,scram);
+  for (i=0;i<100;i++)
+  {
+    point=q.dgen();
+    out->insert(out->end(),point.begin(),point.end());
+  }
+}
+
+void testConcurrent()
+/* Starts generators in several threads at once, so that they fill tables
+ * at the same time, and checks that they give the same points as when
+ * started one at a time.
+ */
+{
+  int i;
+  int dims[]={-40,-40,-41,-39,25};
+  double res[]={0,0,0,0,1e120};
+  int scram[]={QL_SCRAMBLE_POWER,QL_SCRAMBLE_FAURE,QL_SCRAMBLE_TIPWITCH,QL_SCRAMBLE_POWER,QL_SCRAMBLE_THUEMORSE};
+  vector<double> together[5],alone[5];
+  vector<thread> threads;
+  cout<<"Concurrency test\n";
+  for (i=0;i<5;i++)
+    threads.push_back(thread(concurrentGen,dims[i],res[i],scram[i],&together[i]));
+  for (i=0;i<5;i++)
+    threads[i].join();
+  for (i=0;i<5;i++)
+  {
+    concurrentGen(dims[i],res[i],scram[i],&alone[i]);
+    tassert(together[i]==alone[i]);
+  }
+}
+
+void sharedGen(SharedQuadlods *shared,vector<vector<double> > *points)
+/* Takes points from shared until they run out, one at a time or in
+ * blocks of 7, and puts each where its index says.
+ */
+{
+  int i,j,sz=shared->size();
+  uint64_t index;
+  vector<double> point,block(7*sz);
+  for (i=0;;i++)
+    if (i%2)
+    {
+      index=shared->dgen(point);
+      if (index>=points->size())
+	break;
+      (*points)[index]=point;
+    }
+    else
+    {
+      index=shared->dgenBatch(7,&block[0]);
+      for (j=0;j<7 && index+j<points->size();j++)
+	(*points)[index+j]=vector<double>(&block[j*sz],&block[(j+1)*sz]);
+      if (index+7>=points->size())
+	break;
+    }
+}
+
+void testSharedQuadlods()
+/* Checks that threads taking points from a SharedQuadlods get between
+ * them the same points as one generator.
+ */
+{
+  int i,k;
+  double res[]={1e17,1e90,0};
+  Quadlods quad;
+  vector<vector<double> > points(2000);
+  vector<thread> threads;
+  cout<<"Shared generator test\n";
+  for (k=0;k<3;k++)
+  {
+    quad.init(0,res[k]);
+    quad.init(6,res[k]);
+    quad.advance(-4);
+    SharedQuadlods shared(quad);
+    threads.clear();
+    for (i=0;i<4;i++)
+      threads.push_back(thread(sharedGen,&shared,&points));
+    for (i=0;i<4;i++)
+      threads[i].join();
+    for (i=0;i<points.size();i++)
+      tassert(points[i]==quad.dgen());
+  }
+}
+
+void testInit()
+/* Checks the prime index and that each Richtmyer fraction has a big enough
+ * denominator and is close to its quadratic irrational.
+ */
+{
+  int i;
+  Quadlods quad,dup;
+  vector<int> dupPrimes={5,3,5,7,4};
+  cout<<"Initialization test\n";
+  for (i=0;i<QL_MAX_DIMS;i++)
+    tassert(primeIndex(nthprime(i))==i);
+  tassert(primeIndex(4)==-1);
+  tassert(primeIndex(65536)==-1);
+  quad.init(QL_MAX_DIMS,1e30,QL_SCRAMBLE_GRAY);
+  for (i=0;i<QL_MAX_DIMS;i++)
+  {
+    tassert(quad.getdenom(i)>=1e30);
+    tassert(fabs(mpq_class(quad.getnum(i),quad.getdenom(i)).get_d()-nthquad(i,true))<1e-15);
+  }
+  dup.init(dupPrimes,1e10,QL_SCRAMBLE_GRAY);
+  tassert(dup.size()==3);
+  tassert(dup.getprime(2)==7);
+}
+
+void testSharedSpec()
+/* Checks that generators initialized alike share a spec, also after
+ * initializing with no dimensions but not with a different stride, and
+ * that changing one doesn't change the others.
+ */
+{
+  int i;
+  Quadlods a,b,d,f,h,k;
+  vector<double> kpoint;
+  cout<<"Shared spec test\n";
+  a.init(20,1e30,QL_SCRAMBLE_GRAY);
+  b.init(20,1e30,QL_SCRAMBLE_GRAY);
+  tassert(a.getSpec()==b.getSpec());
+  d.init(0,1e30);
+  d.init(20,1e30,QL_SCRAMBLE_GRAY);
+  tassert(a.getSpec()==d.getSpec());
+  f.init(0,1e30);
+  f.setStride(3);
+  f.init(20,1e30,QL_SCRAMBLE_GRAY);
+  tassert(a.getSpec()!=f.getSpec());
+  Quadlods c(a.getSpec());
+  for (i=0;i<100;i++)
+    tassert(a.dgen()==c.dgen());
+  b.setscramble(QL_SCRAMBLE_THIRD);
+  tassert(a.getSpec()!=b.getSpec());
+  tassert(a.getscramble()==QL_SCRAMBLE_GRAY);
+  h.init(30,0);
+  k=h;
+  k.init(40,0);
+  tassert(h.size()==30 && k.size()==40);
+  kpoint=k.dgen();
+  kpoint.resize(30);
+  tassert(h.dgen()==kpoint);
+}
+
+void testCacheDir()
+/* Checks that a spec saved in the cache directory is read back the same,
+ * and that a damaged cache file is ignored.
+ */
+{
+  int i;
+  Quadlods a,b,h,k,x;
+  vector<int> rprimes={2,3,5,7,11,13,17,19,23,29,31,37,41,43,47,53},hprimes={2,3,5,263,4099,65521};
+  filesystem::path dir=filesystem::temp_directory_path()/("quadlods-test-"+to_string(time(nullptr)));
+  filesystem::directory_iterator file;
+  fstream damage;
+  cout<<"Cache directory test\n";
+  filesystem::create_directories(dir);
+  setCacheDir(dir.string());
+  a.init(rprimes,1e40,QL_SCRAMBLE_GRAY);
+  b.init(rprimes,1e40,QL_SCRAMBLE_GRAY);
+  h.init(hprimes,0,QL_SCRAMBLE_TIPWITCH);
+  k.init(hprimes,0,QL_SCRAMBLE_TIPWITCH);
+  tassert(a.getSpec()!=b.getSpec());
+  tassert(h.getSpec()->cacheMap==nullptr && k.getSpec()->cacheMap!=nullptr);
+  for (i=0;i<rprimes.size();i++)
+  {
+    tassert(a.getnum(i)==b.getnum(i));
+    tassert(a.getdenom(i)==b.getdenom(i));
+  }
+  for (i=0;i<1000;i++)
+  {
+    tassert(a.gen()==b.gen());
+    tassert(h.gen()==k.gen());
+  }
+  for (file=filesystem::directory_iterator(dir);file!=filesystem::directory_iterator();++file)
+  {
+    damage.open(file->path(),ios::in|ios::out|ios::binary);
+    damage.seekp(filesystem::file_size(file->path())-4);
+    damage.put('\x55');
+    damage.close();
+  }
+  x.init(hprimes,0,QL_SCRAMBLE_TIPWITCH);
+  tassert(x.getSpec()->cacheMap==nullptr);
+  h.init(0,0);
+  h.init(hprimes,0,QL_SCRAMBLE_TIPWITCH);
+  tassert(h.getSpec()->cacheMap!=nullptr);
+  for (i=0;i<1000;i++)
+    tassert(h.gen()==x.gen());
+  setCacheDir("");
+  filesystem::remove_all(dir);
+}
+
+void testBatch()
+// Checks that dgenBatch and genBatch produce the same tuples as dgen and gen.
+{
+  int i,j,k,sz;
+  Quadlods copy;
+  double res[]={1e17,1e90,0};
+  vector<double> aos,soa,point;
+  vector<mpq_class> qaos,qpoint;
+  cout<<"Batch generation test\n";
+  for (k=0;k<3;k++)
+  {
+    quads[0].init(0,res[k]);
+    quads[0].init(5,res[k]);
+    quads[0].setscramble(QL_SCRAMBLE_DEFAULT);
+    sz=quads[0].size();
+    aos.resize(100*sz);
+    soa.resize(120*sz);
+    qaos.resize(100*sz);
+    copy=quads[0];
+    quads[0].dgenBatch(100,&aos[0]);
+    quads[0].dgenBatch(100,&soa[0],QL_LAYOUT_SOA,120);
+    quads[0].genBatch(100,&qaos[0]);
+    for (i=0;i<300;i++)
+    {
+      if (i<200)
+	point=copy.dgen();
+      else
+	qpoint=copy.gen();
+      for (j=0;j<sz;j++)
+	if (i<100)
+	  tassert(point[j]==aos[i*sz+j]);
+	else if (i<200)
+	  tassert(point[j]==soa[j*120+i-100]);
+	else
+	  tassert(qpoint[j]==qaos[(i-200)*sz+j]);
+    }
+  }
+}
+
+void testParallel()
+/* Checks that dgenParallel writes the same bytes as dgenBatch and leaves
+ * the generator in the same place, including with a stride.
+ */
+{
+  int k,layout;
+  Quadlods copy;
+  double res[]={1e17,1e90,0,1e30};
+  const int n=10000;
+  vector<double> serial,parallel;
+  cout<<"Parallel generation test\n";
+  for (k=0;k<4;k++)
+    for (layout=QL_LAYOUT_AOS;layout<=QL_LAYOUT_SOA;layout++)
+    {
+      quads[0].init(0,res[k]);
+      quads[0].init(7,res[k]);
+      quads[0].advance(-3);
+      if (k==3)
+	quads[0].setStride(3,1);
+      copy=quads[0];
+      serial.resize(n*quads[0].size());
+      parallel.resize(serial.size());
+      copy.dgenBatch(n,&serial[0],layout);
+      quads[0].dgenParallel(n,&parallel[0],layout,0,4);
+      tassert(memcmp(&serial[0],&parallel[0],serial.size()*sizeof(double))==0);
+      tassert(copy.dgen()==quads[0].dgen());
+    }
+}
+
+void testSimd()
+/* Checks that each SIMD level produces the same points as plain C++.
+ * Levels the processor doesn't have are clamped by setSimd.
+ */
+{
+  int i,sc,lvl,oldLvl=quadlods::getSimd();
+  Quadlods copy;
+  vector<double> plain,vec;
+  cout<<"SIMD test\n";
+  for (sc=0;sc<4;sc++)
+  {
+    quads[0].init(0,1e17);
+    quads[0].init(37,1e17);
+    quads[0].setscramble(sc);
+    quads[0].advance(-5);
+    copy=quads[0];
+    plain.resize(50*quads[0].size());
+    vec.resize(plain.size());
+    quadlods::setSimd(QL_SIMD_NONE);
+    quads[0].dgenBatch(50,&plain[0]);
+    for (lvl=QL_SIMD_AVX2;lvl<=QL_SIMD_AVX512;lvl++)
+    {
+      quads[0]=copy;
+      quadlods::setSimd(lvl);
+      quads[0].dgenBatch(50,&vec[0]);
+      for (i=0;i<plain.size();i++)
+	tassert(plain[i]==vec[i]);
+    }
+  }
+  quadlods::setSimd(oldLvl);
 }
 
 void test1AreaInCircle(double minx,double miny,double maxx,double maxy,double rightArea)
@@ -1054,6 +1620,175 @@ void testAreaInCircle()
 	}
 }
 
+void testPointTree()
+/* Checks that the k-d tree counts the same points inside and on the
+ * boundary of boxes as testing each point, with each SIMD level, and that
+ * counting the points of a tree, then those of a tree of later points,
+ * adds up to the same. The coordinates are on a coarse grid so that many
+ * points are on boundaries.
+ */
+{
+  int i,j,k,lvl,in,bound,oldLvl=quadlods::getSimd();
+  vector<vector<double> > points;
+  vector<array<double,2> > bounds(3);
+  array<int,2> count,countMore;
+  cout<<"Point tree test\n";
+  points.resize(500);
+  for (i=0;i<points.size();i++)
+    for (j=0;j<3;j++)
+      points[i].push_back(rng.rangerandom(17)/16.);
+  PointTree tree(points),head(points,0,300),tail(points,300);
+  tassert(tree.size()==points.size());
+  tassert(head.size()+tail.size()==points.size());
+  for (k=0;k<1000;k++)
+  {
+    for (j=0;j<3;j++)
+    {
+      bounds[j][0]=rng.rangerandom(17)/16.;
+      bounds[j][1]=rng.rangerandom(17)/16.;
+      if (bounds[j][0]>bounds[j][1])
+	swap(bounds[j][0],bounds[j][1]);
+    }
+    in=bound=0;
+    for (i=0;i<points.size();i++)
+    {
+      for (j=0;j<3 && points[i][j]>=bounds[j][0] && points[i][j]<=bounds[j][1];j++);
+      if (j==3)
+      {
+	for (j=0;j<3 && points[i][j]!=bounds[j][0] && points[i][j]!=bounds[j][1];j++);
+	if (j==3)
+	  in++;
+	else
+	  bound++;
+      }
+    }
+    for (lvl=QL_SIMD_NONE;lvl<=QL_SIMD_AVX512;lvl++)
+    {
+      quadlods::setSimd(lvl);
+      count=tree.count(bounds);
+      tassert(count[0]==in && count[1]==bound);
+    }
+    count=head.count(bounds);
+    countMore=tail.count(bounds);
+    tassert(count[0]+countMore[0]==in && count[1]+countMore[1]==bound);
+  }
+  quadlods::setSimd(oldLvl);
+  Box whole(points[0],points[1]),part(points[0],points[1]);
+  whole.countPoints(tree);
+  part.countPoints(head);
+  part.countMorePoints(tail);
+  tassert(part.getPointsTotal()==points.size());
+  tassert(part.discrepancy()==whole.discrepancy());
+}
+
+void testKeepPop()
+/* Checks that the boxes discrepancy keeps between calls have the same counts
+ * as counting all the points again, after a call with no new points and
+ * after one with more points. Four dimensions are used so that the boxes
+ * are bred, not found exactly.
+ */
+{
+  int i,n,sz[]={100,100,150};
+  vector<vector<double> > points;
+  PointTree tree;
+  Box whole;
+  cout<<"Kept population test\n";
+  quads[0].init(0,1e17);
+  quads[0].init(4,1e17);
+  population.clear();
+  for (n=0;n<3;n++)
+  {
+    while (points.size()<sz[n])
+      points.push_back(quads[0].dgen());
+    discrepancy(points,true);
+    tree=PointTree(points);
+    tassert(population.size()==3);
+    for (i=0;i<population.size();i++)
+    {
+      whole=population[i];
+      whole.countPoints(tree);
+      tassert(population[i].getPointsTotal()==points.size());
+      tassert(population[i].discrepancy()==whole.discrepancy());
+    }
+  }
+  population.clear();
+}
+
+double bruteDiscrepancy(const vector<vector<double> > &points)
+/* Tries every box whose sides are at coordinates of points or on the
+ * boundary of the domain.
+ */
+{
+  int i,j,dim=points[0].size();
+  vector<vector<double> > coords(dim);
+  vector<int> inx(2*dim,0);
+  vector<double> pnt0(dim),pnt1(dim);
+  PointTree tree(points);
+  double ret=0;
+  for (j=0;j<dim;j++)
+  {
+    coords[j].push_back(flowerDisc[0]);
+    coords[j].push_back(flowerDisc[1]);
+    for (i=0;i<points.size();i++)
+      coords[j].push_back(points[i][j]);
+  }
+  do
+  {
+    for (j=0;j<dim;j++)
+    {
+      pnt0[j]=coords[j][inx[2*j]];
+      pnt1[j]=coords[j][inx[2*j+1]];
+    }
+    Box box(pnt0,pnt1);
+    box.countPoints(tree);
+    ret=max(ret,fabs(box.discrepancy()));
+    for (i=0;i<2*dim && ++inx[i]==coords[i/2].size();i++)
+      inx[i]=0;
+  } while (i<2*dim);
+  return ret;
+}
+
+void testExactDiscrepancy()
+/* Checks the exact discrepancy against trying every box, on points with
+ * coordinates on a coarse grid so that many points line up, including
+ * a flower plot.
+ */
+{
+  int i,j,k,dim;
+  double x,y;
+  vector<vector<double> > points;
+  vector<double> point;
+  cout<<"Exact discrepancy test\n";
+  for (dim=1;dim<=3;dim++)
+    for (k=0;k<10;k++)
+    {
+      points.clear();
+      for (i=0;i<(dim<3?12:6);i++)
+      {
+	point.clear();
+	for (j=0;j<dim;j++)
+	  point.push_back(rng.rangerandom(9)/8.);
+	points.push_back(point);
+      }
+      tassert(fabs(exactDiscrepancy(points)-bruteDiscrepancy(points))<1e-12);
+      tassert(discrepancy(points)==exactDiscrepancy(points));
+    }
+  setFlowerDisc(true);
+  for (k=0;k<10;k++)
+  {
+    points.clear();
+    while (points.size()<12)
+    {
+      x=rng.rangerandom(9)/4.-1;
+      y=rng.rangerandom(9)/4.-1;
+      if (x*x+y*y<=1)
+	points.push_back(vector<double>{x,y});
+    }
+    tassert(fabs(exactDiscrepancy(points)-bruteDiscrepancy(points))<1e-12);
+  }
+  setFlowerDisc(false);
+}
+
 void runTests()
 {
   testContinuedFraction();
@@ -1062,7 +1797,24 @@ void runTests()
   testRandom();
   testSeed();
   testHaltonAccumulator();
+  testInit();
+  testSharedSpec();
+  testCacheDir();
+  testFixedWidth();
+  testIntegerReadout();
+  testHaltonCache();
+  testBatch();
+  testParallel();
+  testPackedHalton();
+  testStride();
+  testPointAt();
+  testConcurrent();
+  testSharedQuadlods();
+  testSimd();
   testAreaInCircle();
+  testPointTree();
+  testKeepPop();
+  testExactDiscrepancy();
 }
 
 void runLongTests()
@@ -1073,9 +1825,9 @@ void runLongTests()
 
 void textOutput()
 {
-  int i,j;
+  int i,j,k,n,sz;
   ostream *out;
-  vector<double> point;
+  vector<double> block;
   if (niter>0 && (ndims>0 || primelist.size()))
   {
     quads[0].init(ndims,resolution);
@@ -1085,16 +1837,22 @@ void textOutput()
       out=new ofstream(filename);
     else
       out=&cout;
-    for (i=0;i<niter;i++)
+    sz=quads[0].size();
+    block.resize(65536*sz);
+    for (i=0;i<niter;i+=n)
     {
-      point=quads[0].dgen();
-      for (j=0;j<point.size();j++)
+      n=min(niter-i,65536);
+      quads[0].dgenParallel(n,&block[0]);
+      for (k=0;k<n;k++)
       {
-	if (j)
-	  *out<<' ';
-	*out<<ldecimal(point[j]);
+	for (j=0;j<sz;j++)
+	{
+	  if (j)
+	    *out<<' ';
+	  *out<<ldecimal(block[k*sz+j]);
+	}
+	*out<<endl;
       }
-      *out<<endl;
     }
     if (filename.length())
       delete out;
@@ -1107,15 +1865,19 @@ void textOutput()
 
 void computeDiscrepancy()
 {
-  int i;
+  int i,sz;
+  vector<double> block;
   vector<vector<double> > points;
   if (niter>1 && (ndims>0 || primelist.size()))
   {
     quads[0].init(ndims,resolution);
     quads[0].init(primelist,resolution);
     quads[0].setscramble(scramble);
+    sz=quads[0].size();
+    block.resize(niter*sz);
+    quads[0].dgenParallel(niter,&block[0]);
     for (i=0;i<niter;i++)
-      points.push_back(quads[0].dgen());
+      points.push_back(vector<double>(&block[i*sz],&block[(i+1)*sz]));
     cout<<ldecimal(discrepancy(points))<<endl;
   }
   if (niter<2)
@@ -1126,9 +1888,10 @@ void computeDiscrepancy()
 
 void plotDiscrepancy()
 {
-  int i;
+  int i,sz;
   set<int> halfsteps=hsteps(1,niter);
   set<int>::iterator it;
+  vector<double> block;
   vector<vector<double> > points;
   vector<int> npts;
   double lastdisc;
@@ -1139,9 +1902,12 @@ void plotDiscrepancy()
     quads[0].init(ndims,resolution);
     quads[0].init(primelist,resolution);
     quads[0].setscramble(scramble);
+    sz=quads[0].size();
+    block.resize(niter*sz);
+    quads[0].dgenParallel(niter,&block[0]);
     for (i=0;i<niter;i++)
     {
-      points.push_back(quads[0].dgen());
+      points.push_back(vector<double>(&block[i*sz],&block[(i+1)*sz]));
       if (halfsteps.count(i+1))
       {
 	npts.push_back(i+1);
@@ -1589,10 +2355,11 @@ int main(int argc,char **argv)
  * -s x		Set the scrambling option (none, third, morse, gray)
  * -n n		Output n lines (textout) or run n iterations (testprimes)
  * -o fname	Write to the specified file
+ * -c dir	Cache generator constants in the specified directory
  */
 {
   int cmd,i;
-  string cmdstr;
+  string cmdstr,cachestr;
   bool validArgs,validCmd=true;
   int nthreads;
   po::options_description generic("Options");
@@ -1608,6 +2375,7 @@ int main(int argc,char **argv)
     ("niter,n",po::value<int>(&niter),"Number of iterations or lines of output")
     ("threads,t",po::value<int>(&nthreads)->default_value(thread::hardware_concurrency()),"Number of threads")
     ("disc","Compute discrepancy of plot")
+    ("cache,c",po::value<string>(&cachestr),"Directory to cache generator constants in")
     ("output,o",po::value<string>(&filename),"Output file");
   hidden.add_options()
     ("command",po::value<string>(&cmdstr),"Command");
@@ -1638,6 +2406,7 @@ int main(int argc,char **argv)
     if (!(resolution>=0))
       cerr<<"Invalid resolution (should be positive number or H): "<<resstr<<endl;
     disc2d=vm.count("disc")>0;
+    setCacheDir(cachestr);
     validArgs=parsePrimeList() && scramble>=0 && resolution>=0;
   }
   catch (exception &e)
@@ -1650,13 +2419,12 @@ int main(int argc,char **argv)
       cmd=i;
   if (nthreads<0)
     nthreads=1;
-  /* Fuzzing should be done with 0 threads, but calculating discrepancy
-   * hangs if done with 0 threads.
+  setThreads(nthreads);
+  /* Fuzzing should be done with 0 threads. Then the thread that waits for
+   * parallel work does all of it. Otherwise the threads are started when
+   * a command first has parallel work.
    */
-  if (cmd==9 && nthreads==0) // discrepancy
-    nthreads=thread::hardware_concurrency();
-  startThreads(nthreads);
-  waitForThreads(TH_RUN);
+  setPoolSize(nthreads);
   switch (nthprime(0)) // This initializes the list of primes.
   {
     case 2:
@@ -1683,7 +2451,6 @@ int main(int argc,char **argv)
   }
   for (i=0;i<0;i++)
     findMinMaxQuad(primes[i]);
-  waitForThreads(TH_STOP);
   joinThreads();
   destroyPlans();
   if (testfail)
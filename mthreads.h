@@ -26,8 +26,10 @@
 #include <../mingw-std-threads/mingw.thread.h>
 #include <../mingw-std-threads/mingw.mutex.h>
 #include <../mingw-std-threads/mingw.shared_mutex.h>
+#include <../mingw-std-threads/mingw.condition_variable.h>
 #else
 #include <thread>
 #include <mutex>
 #include <shared_mutex>
+#include <condition_variable>
 #endif
@@ -0,0 +1,248 @@
+/******************************************************/
+/*                                                    */
+/* pointtree.cpp - k-d tree for counting points       */
+/*                                                    */
+/******************************************************/
+/* Copyright 2026 Pierre Abbat.
+ * This file is part of the Quadlods program.
+ * 
+ * The Quadlods program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Quadlods is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Quadlods. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define PT_X86_SIMD
+#endif
+#include "quadlods.h"
+#include "pointtree.h"
+using namespace std;
+
+void countLeafScalar(const double *coords,int stride,int dim,int begin,int end,
+		     const array<double,2> *bounds,int &open,int &closed)
+/* Adds the number of points from begin to end-1 in the open box to open,
+ * and the number in the closed box to closed.
+ */
+{
+  int i,j,ptin;
+  for (i=begin;i<end;i++)
+  {
+    ptin=2;
+    for (j=0;j<dim && ptin;j++)
+    {
+      if (coords[j*stride+i]==bounds[j][0] || coords[j*stride+i]==bounds[j][1])
+	ptin=1;
+      if (coords[j*stride+i]<bounds[j][0] || coords[j*stride+i]>bounds[j][1])
+	ptin=0;
+    }
+    if (ptin==2)
+      open++;
+    if (ptin)
+      closed++;
+  }
+}
+
+#ifdef PT_X86_SIMD
+/* The vector kernels test four (AVX2) or eight (AVX-512) points at once,
+ * making a mask of the points in the closed box and a mask of the points
+ * on a face, and counting them with popcount. The last few points of a
+ * leaf are masked off, and a group stops as soon as all its points are out.
+ */
+__attribute__((target("avx2,popcnt")))
+void countLeafAvx2(const double *coords,int stride,int dim,int begin,int end,
+		   const array<double,2> *bounds,int &open,int &closed)
+{
+  int i,j,inMask;
+  __m256d x,lo,hi,in,face;
+  const __m256i lanes=_mm256_setr_epi64x(0,1,2,3);
+  for (i=begin;i<end;i+=4)
+  {
+    in=_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_set1_epi64x(end-i),lanes));
+    face=_mm256_setzero_pd();
+    for (j=0;j<dim && !_mm256_testz_pd(in,in);j++)
+    {
+      x=_mm256_maskload_pd(coords+j*stride+i,_mm256_castpd_si256(in));
+      lo=_mm256_set1_pd(bounds[j][0]);
+      hi=_mm256_set1_pd(bounds[j][1]);
+      in=_mm256_and_pd(in,_mm256_and_pd(_mm256_cmp_pd(x,lo,_CMP_GE_OQ),_mm256_cmp_pd(x,hi,_CMP_LE_OQ)));
+      face=_mm256_or_pd(face,_mm256_or_pd(_mm256_cmp_pd(x,lo,_CMP_EQ_OQ),_mm256_cmp_pd(x,hi,_CMP_EQ_OQ)));
+    }
+    inMask=_mm256_movemask_pd(in);
+    closed+=__builtin_popcount(inMask);
+    open+=__builtin_popcount(inMask&~_mm256_movemask_pd(face));
+  }
+}
+
+__attribute__((target("avx512f,popcnt")))
+void countLeafAvx512(const double *coords,int stride,int dim,int begin,int end,
+		     const array<double,2> *bounds,int &open,int &closed)
+{
+  int i,j;
+  __m512d x,lo,hi;
+  __mmask8 in,face;
+  for (i=begin;i<end;i+=8)
+  {
+    in=(end-i<8)?(1<<(end-i))-1:0xff;
+    face=0;
+    for (j=0;j<dim && in;j++)
+    {
+      x=_mm512_maskz_loadu_pd(in,coords+j*stride+i);
+      lo=_mm512_set1_pd(bounds[j][0]);
+      hi=_mm512_set1_pd(bounds[j][1]);
+      in=_mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(in,x,lo,_CMP_GE_OQ),x,hi,_CMP_LE_OQ);
+      face|=_mm512_cmp_pd_mask(x,lo,_CMP_EQ_OQ)|_mm512_cmp_pd_mask(x,hi,_CMP_EQ_OQ);
+    }
+    closed+=__builtin_popcount(in);
+    open+=__builtin_popcount(in&~face);
+  }
+}
+#endif
+
+void countLeaf(const double *coords,int stride,int dim,int begin,int end,
+	       const array<double,2> *bounds,int &open,int &closed)
+{
+  switch (quadlods::getSimd())
+  {
+#ifdef PT_X86_SIMD
+    case QL_SIMD_AVX512:
+      countLeafAvx512(coords,stride,dim,begin,end,bounds,open,closed);
+      break;
+    case QL_SIMD_AVX2:
+      countLeafAvx2(coords,stride,dim,begin,end,bounds,open,closed);
+      break;
+#endif
+    default:
+      countLeafScalar(coords,stride,dim,begin,end,bounds,open,closed);
+  }
+}
+
+PointTree::PointTree()
+{
+  dim=npoints=stride=0;
+}
+
+PointTree::PointTree(const vector<vector<double> > &points,int begin,int end)
+{
+  int i,j;
+  vector<int> order;
+  if (end<0)
+    end=points.size();
+  npoints=(end>begin)?end-begin:0;
+  dim=npoints?points[begin].size():0;
+  for (i=0;i<npoints;i++)
+    order.push_back(begin+i);
+  if (npoints)
+    build(order,points,0,npoints);
+  stride=(npoints+7)&-8;
+  coords.resize(stride*dim);
+  for (i=0;i<npoints;i++)
+    for (j=0;j<dim;j++)
+      coords[j*stride+i]=points[order[i]][j];
+}
+
+int PointTree::build(vector<int> &order,const vector<vector<double> > &points,int begin,int end)
+/* Makes a node for points order[begin] through order[end-1], splitting it
+ * if there are more than PT_LEAF of them, and returns its index.
+ */
+{
+  int i,j,n=nodes.size(),mid,split=0,sub;
+  double spread,maxSpread=0;
+  nodes.push_back(PointNode{begin,end,-1,-1});
+  lo.resize(lo.size()+dim);
+  hi.resize(hi.size()+dim);
+  for (j=0;j<dim;j++)
+  {
+    lo[n*dim+j]=hi[n*dim+j]=points[order[begin]][j];
+    for (i=begin+1;i<end;i++)
+    {
+      if (points[order[i]][j]<lo[n*dim+j])
+	lo[n*dim+j]=points[order[i]][j];
+      if (points[order[i]][j]>hi[n*dim+j])
+	hi[n*dim+j]=points[order[i]][j];
+    }
+    spread=hi[n*dim+j]-lo[n*dim+j];
+    if (spread>maxSpread)
+    {
+      maxSpread=spread;
+      split=j;
+    }
+  }
+  if (end-begin>PT_LEAF && maxSpread>0)
+  { // If all the points are the same, the node is a leaf, however big.
+    mid=(begin+end)/2;
+    nth_element(order.begin()+begin,order.begin()+mid,order.begin()+end,
+		[&points,split](int a,int b){return points[a][split]<points[b][split];});
+    sub=build(order,points,begin,mid);
+    nodes[n].left=sub;
+    sub=build(order,points,mid,end);
+    nodes[n].right=sub;
+  }
+  return n;
+}
+
+array<int,2> PointTree::count(const vector<array<double,2> > &bounds) const
+{
+  int open=0,closed=0;
+  if (npoints)
+    count(0,bounds,open,closed,true);
+  return array<int,2>{open,closed-open};
+}
+
+void PointTree::count(int n,const vector<array<double,2> > &bounds,int &open,int &closed,bool countClosed) const
+/* Adds the number of points of node n in the open box to open, and,
+ * if countClosed, the number in the closed box to closed. A point is
+ * in the open box if it is in the closed box and on none of its faces.
+ */
+{
+  int j,leafOpen=0,leafClosed=0;
+  bool inOpen=true,inClosed=true,meetsOpen=true;
+  const PointNode &node=nodes[n];
+  const double *nlo=&lo[n*dim],*nhi=&hi[n*dim];
+  for (j=0;j<dim;j++)
+  {
+    if (nhi[j]<bounds[j][0] || nlo[j]>bounds[j][1])
+      return;
+    if (nhi[j]<=bounds[j][0] || nlo[j]>=bounds[j][1])
+      meetsOpen=false;
+    if (nlo[j]<bounds[j][0] || nhi[j]>bounds[j][1])
+      inClosed=false;
+    if (nlo[j]<=bounds[j][0] || nhi[j]>=bounds[j][1])
+      inOpen=false;
+  }
+  if (inClosed && countClosed)
+  {
+    closed+=node.end-node.begin;
+    countClosed=false;
+  }
+  if (inOpen)
+    open+=node.end-node.begin;
+  else if (meetsOpen || countClosed)
+  {
+    if (node.left<0)
+    {
+      countLeaf(&coords[0],stride,dim,node.begin,node.end,&bounds[0],leafOpen,leafClosed);
+      open+=leafOpen;
+      if (countClosed)
+	closed+=leafClosed;
+    }
+    else
+    {
+      count(node.left,bounds,open,closed,countClosed);
+      count(node.right,bounds,open,closed,countClosed);
+    }
+  }
+}
@@ -0,0 +1,79 @@
+/******************************************************/
+/*                                                    */
+/* pointtree.h - k-d tree for counting points         */
+/*                                                    */
+/******************************************************/
+/* Copyright 2026 Pierre Abbat.
+ * This file is part of the Quadlods program.
+ * 
+ * The Quadlods program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * Quadlods is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License and Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * and Lesser General Public License along with Quadlods. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POINTTREE_H
+#define POINTTREE_H
+
+#include <vector>
+#include <array>
+
+#define PT_LEAF 32
+
+struct PointNode
+/* A node covers points begin through end-1 in tree order. lo and hi,
+ * in PointTree, hold the bounding box of those points. A leaf has
+ * left=right=-1.
+ */
+{
+  int begin,end,left,right;
+};
+
+class PointTree
+/* A k-d tree over a set of points, built once per discrepancy calculation,
+ * for counting the points inside a box and on its boundary. Each node
+ * splits its points at the median of the coordinate in which they spread
+ * the most. A node entirely inside or outside a box is counted without
+ * looking at its points, so a count looks at few points besides those
+ * near the boundary of the box.
+ */
+{
+public:
+  PointTree();
+  PointTree(const std::vector<std::vector<double> > &points,int begin=0,int end=-1);
+  // Makes a tree of points begin through end-1, or through the last if end<0.
+  int size() const
+  {
+    return npoints;
+  }
+  int dimensions() const
+  {
+    return dim;
+  }
+  std::array<int,2> count(const std::vector<std::array<double,2> > &bounds) const;
+  // Returns the number of points inside the box and on its boundary.
+private:
+  int dim,npoints;
+  /* The points in tree order, dimension-major: coordinate j of point i is
+   * coords[j*stride+i], so that the points of a leaf are contiguous in each
+   * dimension for the vector kernels. stride is a multiple of 8.
+   */
+  std::vector<double> coords;
+  int stride;
+  std::vector<double> lo,hi; // dim per node
+  std::vector<PointNode> nodes;
+  int build(std::vector<int> &order,const std::vector<std::vector<double> > &points,int begin,int end);
+  void count(int n,const std::vector<std::array<double,2> > &bounds,int &open,int &closed,bool countClosed) const;
+};
+
+#endif
@@ -38,7 +38,34 @@
 #include <cfloat>
 #include <cmath>
 #include <string>
+#include <cstring>
+#include <cstdio>
 #include <array>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <tuple>
+#include <deque>
+#ifdef __MINGW64__
+#include <../mingw-std-threads/mingw.thread.h>
+#include <../mingw-std-threads/mingw.mutex.h>
+#else
+#include <thread>
+#include <mutex>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define QL_X86_SIMD
+#endif
 #include "quadlods.h"
 #include "config.h"
 
@@ -47,35 +74,203 @@
 using namespace std;
 using namespace quadlods;
 
+#ifdef QL_EMBED_DATA
+// Put in by embeddata.S; see CMakeLists.txt.
+extern "C"
+{
+  extern const unsigned char quadlodsPrimesData[],quadlodsPrimesEnd[];
+  extern const unsigned char quadlodsPermuteData[],quadlodsPermuteEnd[];
+}
+#endif
+
 namespace quadlods
 {
-  map<unsigned,unsigned> relprimes;
-  vector<unsigned short> primes;
-  map<int,int> scrambleFileIndex,permuteFileIndex;
-  map<unsigned,vector<unsigned short> > reverseScrambleTable;
+  constexpr array<unsigned short,QL_MAX_DIMS> listPrimes()
+  // Sieves the primes below 65536 at compile time.
+  {
+    array<unsigned short,QL_MAX_DIMS> ret{};
+    bool composite[65536]={};
+    int i=0,j=0,n=0;
+    for (i=2;i<65536;i++)
+      if (!composite[i])
+      {
+	ret[n++]=i;
+	for (j=2*i;j<65536;j+=i)
+	  composite[j]=true;
+      }
+    return ret;
+  }
+  constexpr array<int,QL_MAX_DIMS> listPermuteOffsets(const array<unsigned short,QL_MAX_DIMS> &p)
+  /* The row for the nth prime p starts here in permute.dat and is 2p+n-5
+   * bytes long. 2 and 3 have no row.
+   */
+  {
+    array<int,QL_MAX_DIMS> ret{};
+    int i=0,pos=0;
+    for (i=0;i<QL_MAX_DIMS;i++)
+      if (p[i]<4)
+	ret[i]=-1;
+      else
+      {
+	ret[i]=pos;
+	pos+=2*p[i]+i-5;
+      }
+    return ret;
+  }
+  /* The tables below are shared by all generators. primesCfSorted is
+   * written once, under primesOnce. A reverse scramble table is written
+   * once, with tableMutex held, and never changes after; generators keep
+   * pointers to the ones they use, so reading them needs no lock.
+   * thue and third are computed before main, and primes and
+   * permuteOffsets when compiling.
+   */
+  constexpr array<unsigned short,QL_MAX_DIMS> primes=listPrimes();
+  constexpr array<int,QL_MAX_DIMS> permuteOffsets=listPermuteOffsets(primes);
+  /* The reverse scramble tables are in scrambleArena, which grows a chunk
+   * at a time, so that a table never moves. Each different table is stored
+   * only once: the identity permutation of digits, for instance, is the same
+   * for four scramble types. scrambleHash finds a table by its contents,
+   * and reverseScrambleTable finds it by scramble type and prime.
+   */
+  const int arenaChunk=1<<20;
+  vector<unique_ptr<unsigned short[]> > scrambleArena;
+  int arenaUsed=0,arenaSize=0;
+  multimap<uint64_t,pair<int,const unsigned short *> > scrambleHash;
+  map<unsigned,const unsigned short *> reverseScrambleTable;
+  bool computeScramble=false;
+  atomic<int> threadCount(thread::hardware_concurrency());
   vector<PrimeContinuedFraction> primesCfSorted;
-  mpz_class thue(0x69969669),third(0x55555555);
-  int morse(32),b2adic(32);
+  once_flag primesOnce;
+  /* primeIndexTable[p] is n such that nthprime(n)==p, or -1 if p isn't
+   * prime, and is filled with primesCfSorted. quadTable holds nthquad(n)
+   * and nthquad(n,true) and is filled the first time nthquad is called.
+   */
+  vector<short> primeIndexTable;
+  vector<double> quadTable;
+  once_flag quadOnce;
+  void initquads();
+  /* Specs whose dimensions were all filled by one call to init, by mode,
+   * primes, resolution, scrambling, and stride, so that generators
+   * initialized the same way share them.
+   */
+  typedef tuple<int,vector<short>,double,int,int> SpecKey;
+  map<SpecKey,weak_ptr<const SequenceSpec> > specCache;
+  mutex specMutex;
+  shared_ptr<const SequenceSpec> emptySpec();
+  shared_ptr<const SequenceSpec> cachedSpec(const SequenceSpec &s,double resolution);
+  void cacheSpec(shared_ptr<const SequenceSpec> s,double resolution);
+  mutex tableMutex;
+  const int scrambleBits=1088; // enough for a resolution of 1e308
+  mpz_class thueMorseBits(int n);
+  mpz_class thirdBits(int n);
+  mpz_class thue=thueMorseBits(scrambleBits),third=thirdBits(scrambleBits);
+  class MappedFile
+  /* A data file mapped read-only into memory. If the file can't be opened,
+   * data is null and size is 0.
+   */
+  {
+  public:
+    const unsigned char *data;
+    size_t size;
+    MappedFile();
+    ~MappedFile();
+    MappedFile(const MappedFile &)=delete;
+    MappedFile &operator=(const MappedFile &)=delete;
+    void open(string fileName);
+    void close();
+  private:
+#ifdef _WIN32
+    HANDLE file,mapping;
+#endif
+  };
+  MappedFile permuteFile;
+  const unsigned char *permuteStart,*permuteEnd;
+  once_flag permuteOnce;
+  void openPermuteFile();
+  /* If cacheDir is set, init keeps the specs it computes from nothing there,
+   * one file per spec, named by the checksum of the file's head, which
+   * holds the mode, scramble type, resolution, and primes. A Halton spec
+   * read from the cache uses the tables in the mapped file.
+   */
+  string cacheDir;
+  const uint64_t cacheMagic=0x3145484341434c51; // "QLCACHE1"
+  const uint64_t checksumStart=0xcbf29ce484222325;
+  uint64_t checksumWords(const unsigned char *data,size_t n,uint64_t sum);
+  string cacheHead(const SequenceSpec &s,double resolution);
+  string cacheName(const string &head);
+  void appendCache(string &buf,const void *src,size_t n);
+  void padCache(string &buf);
+  bool readCache(const unsigned char *&ptr,const unsigned char *end,void *dest,size_t n);
+  void writeCacheChunk(ofstream &file,string &buf,uint64_t *header);
+  bool loadSpec(SequenceSpec &s,double resolution);
+  void saveSpec(const SequenceSpec &s,double resolution);
   int primePowerTable[][2]=
   {
     {16,65536},{10,59049},{8,65536},{6,15625},{6,46656},{5,16807},
     {5,32768},{5,59049},{4,10000},{4,14641},{4,20736},{4,28561}
   };
   array<int,2> primePower(unsigned short p);
-  short readshort(istream &file);
-  vector<unsigned short> readSteps(istream &file,int prime);
-  vector<unsigned short> readPerm(istream &file,int n);
+  /* ppPowers[pp][j] is pp**(2**j), for converting increments to base pp.
+   * A deque is used so that references to the powers stay good while
+   * another thread appends to it.
+   */
+  map<int,deque<mpz_class> > ppPowers;
+  mutex powerMutex;
+  void radixDigits(unsigned short *digits,const mpz_class &n,int j,int pp,const mpz_class *const *powers);
+  short readshort(const unsigned char *&ptr,const unsigned char *end);
+  vector<unsigned short> readSteps(const unsigned char *&ptr,const unsigned char *end,int prime);
+  vector<unsigned short> readPerm(const unsigned char *&ptr,const unsigned char *end,int n);
   bool isPerm(vector<unsigned short> &perm);
   vector<unsigned short> readRow(int prime);
   int reverseScramble(int limb,int p,int scrambletype);
-  mpz_class thuemorse(int n);
-  mpz_class minusthird(int n);
-  mpz_class graydecode(mpz_class n);
-  mpz_class scramble(mpz_class acc,mpz_class denom,int scrambletype);
+  unsigned powerdig(unsigned dig,unsigned p,unsigned pow);
+  vector<unsigned short> powerPerm(unsigned p);
+  unsigned short *arenaAlloc(int n);
+  const unsigned short *storeTable(const unsigned short *table,int n);
+  void scrambleMpz(mpz_t ret,const mpz_t acc,const mpz_t denom,int scrambletype,mpz_t tmp0,mpz_t tmp1);
+  mpz_class scramble(const mpz_class &acc,const mpz_class &denom,int scrambletype);
+  const uint64_t thueWords[4]=
+  { // thuemorse(256), least significant first
+    0x6996966969969669,0x9669699669969669,0x9669699669969669,0x6996966996696996
+  };
+  const uint64_t thirdWord=0x5555555555555555;
+  void mpzToLimbs(uint64_t *limbs,const mpz_class &n,int nlimbs);
+  mpz_class limbsToMpz(const uint64_t *limbs,int nlimbs);
+  template<int N> int bitLength(const uint64_t *a);
+  template<int N> int compareLimbs(const uint64_t *a,const uint64_t *b);
+  template<int N> void subLimbs(uint64_t *a,const uint64_t *b);
+  template<int N> void shiftLeftLimbs(uint64_t *a,int n);
+  template<int N> void mulLimbs(uint64_t *ret,const uint64_t *a,uint64_t m);
+  template<int N> void addmodLimbs(uint64_t *acc,const uint64_t *num,const uint64_t *denom);
+  template<int N> void scrambleLimbs(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int scrambletype);
+  template<int N> double limbsReadout(const uint64_t *s,const uint64_t *denom);
+  template<int N> uint64_t limbsScale(const uint64_t *s,const uint64_t *denom,uint64_t m);
+  void addmodBlockScalar(uint64_t *acc,const uint64_t *num,const uint64_t *denom,int n);
+  void scrambleBlockScalar(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int n,int scrambletype);
+#ifdef QL_X86_SIMD
+  void addmodBlockAvx2(uint64_t *acc,const uint64_t *num,const uint64_t *denom,int n);
+  void scrambleBlockAvx2(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int n,int scrambletype);
+  void addmodBlockAvx512(uint64_t *acc,const uint64_t *num,const uint64_t *denom,int n);
+  void scrambleBlockAvx512(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int n,int scrambletype);
+#endif
+  int cpuSimd();
+  atomic<int> simdLevel(cpuSimd()); // read by generators in any thread
+  void addmodBlock(uint64_t *acc,const uint64_t *num,const uint64_t *denom,int n);
+  void scrambleBlock(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int n,int scrambletype);
   void initprimes();
   void compquad(int p,double resolution,mpz_class &nmid,mpz_class &dmid);
   void compquad(ContinuedFraction cf,double resolution,mpz_class &nmid,mpz_class &dmid);
   mpq_class haccReverseScramble(vector<unsigned short> &hacc,int p,int scrambletype,bool sign);
+  mpq_class haccReadout(const vector<unsigned short> &hacc,int pp,const ScrambleRow &row,bool sign);
+  uint64_t haccScale(const vector<unsigned short> &hacc,int pp,const ScrambleRow &row,bool sign,uint64_t m);
+  void packLimbs(vector<uint64_t> &word,int &len,const vector<unsigned short> &hacc);
+  void unpackLimbs(vector<unsigned short> &hacc,const vector<uint64_t> &word,int len);
+  bool incHword(vector<uint64_t> &word,int &len,int pp,int increment,int pos,bool sign);
+  const unsigned short *findReverseScrambleRow(int p,int scrambletype);
+  ScrambleRow reverseScrambleRow(int p,int scrambletype);
+  unsigned __int128 truncate53(unsigned __int128 x);
+  double fixedToDouble(unsigned __int128 x);
+  double haccDouble(vector<unsigned short> &frac,const vector<uint64_t> &word,int len,int pp,const ScrambleRow &row,bool sign);
 }
 
 unsigned quadlods::gcd(unsigned a,unsigned b)
@@ -93,11 +288,96 @@ unsigned quadlods::gcd(unsigned a,unsigned b)
   return a+b;
 }
 
-short quadlods::readshort(istream &file)
+quadlods::MappedFile::MappedFile()
+{
+  data=nullptr;
+  size=0;
+#ifdef _WIN32
+  file=mapping=nullptr;
+#endif
+}
+
+quadlods::MappedFile::~MappedFile()
+{
+  close();
+}
+
+void quadlods::MappedFile::open(string fileName)
+{
+  close();
+#ifdef _WIN32
+  LARGE_INTEGER len;
+  file=CreateFileA(fileName.c_str(),GENERIC_READ,FILE_SHARE_READ,nullptr,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,nullptr);
+  if (file==INVALID_HANDLE_VALUE)
+    file=nullptr;
+  if (file && GetFileSizeEx(file,&len) && len.QuadPart>0)
+    mapping=CreateFileMappingA(file,nullptr,PAGE_READONLY,0,0,nullptr);
+  if (mapping)
+    data=(const unsigned char *)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+  if (data)
+    size=len.QuadPart;
+  else
+    close();
+#else
+  struct stat st;
+  void *addr=MAP_FAILED;
+  int fd=::open(fileName.c_str(),O_RDONLY);
+  if (fd>=0)
+  {
+    if (fstat(fd,&st)==0 && st.st_size>0)
+      addr=mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    ::close(fd);
+  }
+  if (addr!=MAP_FAILED)
+  {
+    data=(const unsigned char *)addr;
+    size=st.st_size;
+  }
+#endif
+}
+
+void quadlods::MappedFile::close()
+{
+#ifdef _WIN32
+  if (data)
+    UnmapViewOfFile(data);
+  if (mapping)
+    CloseHandle(mapping);
+  if (file)
+    CloseHandle(file);
+  file=mapping=nullptr;
+#else
+  if (data)
+    munmap((void *)data,size);
+#endif
+  data=nullptr;
+  size=0;
+}
+
+void quadlods::openPermuteFile()
 {
-  char buf[2];
-  file.read(buf,2);
-  return *(short *)buf;
+#ifdef QL_EMBED_DATA
+  permuteStart=quadlodsPermuteData;
+  permuteEnd=quadlodsPermuteEnd;
+#else
+  permuteFile.open(string(SHARE_DIR)+"/permute.dat");
+  permuteStart=permuteFile.data;
+  permuteEnd=permuteFile.data+permuteFile.size;
+#endif
+}
+
+short quadlods::readshort(const unsigned char *&ptr,const unsigned char *end)
+// Reads a short and advances ptr. Past the end, returns 0.
+{
+  short ret=0;
+  if (end-ptr>=2)
+  {
+    memcpy(&ret,ptr,2);
+    ptr+=2;
+  }
+  else
+    ptr=end;
+  return ret;
 }
 
 unsigned quadlods::relprime(unsigned n)
@@ -105,16 +385,11 @@ unsigned quadlods::relprime(unsigned n)
 {
   unsigned ret,twice;
   double phin;
-  ret=relprimes[n];
-  if (!ret)
-  {
-    phin=n*M_1PHI;
-    ret=rint(phin);
-    twice=2*ret-(ret>phin);
-    while (gcd(ret,n)!=1)
-      ret=twice-ret+(ret<=phin);
-    relprimes[n]=ret;
-  }
+  phin=n*M_1PHI;
+  ret=rint(phin);
+  twice=2*ret-(ret>phin);
+  while (gcd(ret,n)!=1)
+    ret=twice-ret+(ret<=phin);
   return ret;
 }
 
@@ -123,7 +398,13 @@ unsigned quadlods::scrambledig(unsigned dig,unsigned p)
  * the Halton generator. -1, 0, and 1 are unaffected.
  */
 {
-  unsigned acc=1,pow=relprime(p-1);
+  return powerdig(dig,p,relprime(p-1));
+}
+
+unsigned quadlods::powerdig(unsigned dig,unsigned p,unsigned pow)
+// Raises dig to the power pow mod p. pow must be less than 65536.
+{
+  unsigned acc=1;
   int i;
   for (i=15;i>=0;i--)
   {
@@ -134,6 +415,44 @@ unsigned quadlods::scrambledig(unsigned dig,unsigned p)
   return acc;
 }
 
+vector<unsigned short> quadlods::powerPerm(unsigned p)
+/* Returns scrambledig(i,p) for all i<p. Stepping through the powers of
+ * a primitive root g, g**k goes to g**(k*pow), which takes a multiplication
+ * per digit instead of raising each digit to pow.
+ */
+{
+  vector<unsigned short> ret(p,0);
+  vector<unsigned> factors;
+  unsigned g=1,gpow,n,q,x=1,y=1;
+  int i;
+  bool primitive=false;
+  for (n=p-1,q=2;q*q<=n;q++)
+    if (n%q==0)
+    {
+      factors.push_back(q);
+      while (n%q==0)
+	n/=q;
+    }
+  if (n>1)
+    factors.push_back(n);
+  while (!primitive)
+  {
+    g++;
+    primitive=true;
+    for (i=0;i<factors.size();i++)
+      if (powerdig(g,p,(p-1)/factors[i])==1)
+	primitive=false;
+  }
+  gpow=powerdig(g,p,relprime(p-1));
+  for (i=0;i<p-1;i++)
+  {
+    ret[x]=y;
+    x=x*g%p;
+    y=y*gpow%p;
+  }
+  return ret;
+}
+
 unsigned quadlods::faureperm(unsigned dig,unsigned p)
 {
   if (dig>0 && dig+1<p && 2*dig+1!=p)
@@ -148,7 +467,7 @@ unsigned quadlods::faureperm(unsigned dig,unsigned p)
   return dig;
 }
 
-vector<unsigned short> quadlods::readSteps(istream &file,int prime)
+vector<unsigned short> quadlods::readSteps(const unsigned char *&ptr,const unsigned char *end,int prime)
 /* Reads a sequence of bytes, such as 03 03 04 01 01 08 06 03 01, which add up
  * to prime-1 (in this case prime=31), and returns the steps, in this case
  * 00 03 06 0a 0b 0c 14 1a 1d 1e.
@@ -159,7 +478,7 @@ vector<unsigned short> quadlods::readSteps(istream &file,int prime)
   while (sum+1<prime && ch>=0)
   {
     ret.push_back(sum);
-    ch=file.get();
+    ch=(ptr<end)?*ptr++:-1;
     if (ch==0) // There are no zeros in the step bytes. The max step is 150.
       ch=256;  // This keeps the program from getting stuck on a run of zeros.
     sum+=ch;
@@ -168,18 +487,18 @@ vector<unsigned short> quadlods::readSteps(istream &file,int prime)
   return ret;
 }
 
-vector<unsigned short> quadlods::readPerm(istream &file,int n)
+vector<unsigned short> quadlods::readPerm(const unsigned char *&ptr,const unsigned char *end,int n)
 /* Reads a sequence of shorts, such as 0007 fffc 0002 fffc 0005 fffc 0002 fffc,
  * which are differences, and returns the permutation, in this case
  * 7 3 5 1 6 2 4 0.
  */
 {
   int i,sum=0;
-  vector<unsigned short> ret;
+  vector<unsigned short> ret(n);
   for (i=0;i<n;i++)
   {
-    sum+=readshort(file);
-    ret.push_back(sum);
+    sum+=readshort(ptr,end);
+    ret[i]=sum;
   }
   return ret;
 }
@@ -209,11 +528,30 @@ bool quadlods::isPerm(vector<unsigned short> &perm)
 }
 
 vector<unsigned short> quadlods::readRow(int prime)
+/* Decodes the row for prime from the mapped permutation file. If the file
+ * is missing or the row is bad, returns the identity.
+ */
 {
-  ifstream permuteFile(string(SHARE_DIR)+"/permute.dat",ios::binary);
-  int i,j,pos;
+  int i,j,pos=-1;
+  const unsigned char *ptr,*end;
   vector<unsigned short> stairs,skipStairs,perm0,perm1,ret;
-  pos=permuteFileIndex[prime];
+  call_once(permuteOnce,openPermuteFile);
+  i=lower_bound(primes.begin(),primes.end(),prime)-primes.begin();
+  if (i<QL_MAX_DIMS && primes[i]==prime)
+    pos=permuteOffsets[i];
+  if (pos>=0)
+  {
+    end=permuteEnd;
+    ptr=(pos<end-permuteStart)?permuteStart+pos:end;
+    stairs=readSteps(ptr,end,prime);
+    perm0=readPerm(ptr,end,prime-stairs.size());
+    perm1=readPerm(ptr,end,stairs.size()-2);
+    if (!isPerm(perm0) || !isPerm(perm1))
+    {
+      cerr<<"Permutation file is corrupt or failed to read\n";
+      pos=-1;
+    }
+  }
   if (pos<0)
   {
     for (i=0;i<prime;i++)
@@ -221,12 +559,6 @@ vector<unsigned short> quadlods::readRow(int prime)
   }
   else
   {
-    permuteFile.seekg(pos,permuteFile.beg);
-    stairs=readSteps(permuteFile,prime);
-    perm0=readPerm(permuteFile,prime-stairs.size());
-    perm1=readPerm(permuteFile,stairs.size()-2);
-    if (!isPerm(perm0) || !isPerm(perm1))
-      cerr<<"Permutation file is corrupt or failed to read\n";
     for (i=j=0;i<prime;i++)
       if (i==stairs[j])
 	j++;
@@ -283,48 +615,136 @@ void quadlods::fillReverseScrambleTable(int p,int scrambletype)
 {
   array<int,2> pp=primePower(p);
   int i,j,dec,acc;
-  vector<unsigned short> scrambleTable,row;
+  vector<unsigned short> scrambleTable;
+  unsigned short *table;
   int inx=(scrambletype<<16)+p;
+  lock_guard<mutex> lock(tableMutex);
   if ((scrambletype==QL_SCRAMBLE_POWER ||
        scrambletype==QL_SCRAMBLE_FAURE ||
        scrambletype==QL_SCRAMBLE_TIPWITCH ||
-       p<256) && reverseScrambleTable[inx].size()==0)
-  {
-    for (i=0;i<p;i++)
-      if (scrambletype==QL_SCRAMBLE_POWER)
-	scrambleTable.push_back(scrambledig(i,p));
-      else if (scrambletype==QL_SCRAMBLE_FAURE)
-	scrambleTable.push_back(faureperm(i,p));
-      else if (scrambletype==QL_SCRAMBLE_TIPWITCH)
-      {
-	if (row.size()==0)
-	  row=readRow(p);
-	scrambleTable.push_back(row[i]);
-      }
-      else
-	scrambleTable.push_back(i);
-    for (i=0;i<pp[1];i++)
+       p<256) && reverseScrambleTable.count(inx)==0)
+  {
+    if (scrambletype==QL_SCRAMBLE_POWER)
+      scrambleTable=powerPerm(p);
+    else if (scrambletype==QL_SCRAMBLE_TIPWITCH)
+      scrambleTable=readRow(p);
+    else
+      for (i=0;i<p;i++)
+	if (scrambletype==QL_SCRAMBLE_FAURE)
+	  scrambleTable.push_back(faureperm(i,p));
+	else
+	  scrambleTable.push_back(i);
+    table=arenaAlloc(pp[1]);
+    if (pp[0]==1)
+      memcpy(table,&scrambleTable[0],p*sizeof(unsigned short));
+    else
     {
-      acc=0;
-      dec=i;
-      for (j=0;j<pp[0];j++)
+      for (i=0;i<pp[1];i++)
       {
-	acc=p*acc+scrambleTable[dec%p];
-	dec/=p;
+	acc=0;
+	dec=i;
+	for (j=0;j<pp[0];j++)
+	{
+	  acc=p*acc+scrambleTable[dec%p];
+	  dec/=p;
+	}
+	table[i]=acc;
       }
-      reverseScrambleTable[inx].push_back(acc);
     }
+    reverseScrambleTable[inx]=storeTable(table,pp[1]);
+  }
+}
+
+unsigned short *quadlods::arenaAlloc(int n)
+// Returns room for n entries in scrambleArena. Call with tableMutex held.
+{
+  unsigned short *ret;
+  if (arenaUsed+n>arenaSize)
+  {
+    arenaSize=max(n,arenaChunk);
+    arenaUsed=0;
+    scrambleArena.emplace_back(new unsigned short[arenaSize]);
+  }
+  ret=scrambleArena.back().get()+arenaUsed;
+  arenaUsed+=n;
+  return ret;
+}
+
+const unsigned short *quadlods::storeTable(const unsigned short *table,int n)
+/* table is the last thing allocated by arenaAlloc. If an earlier table
+ * is the same, frees table and returns the earlier one.
+ * Call with tableMutex held.
+ */
+{
+  uint64_t hash=0xcbf29ce484222325,word; // FNV-1a, four entries at a time
+  int i;
+  multimap<uint64_t,pair<int,const unsigned short *> >::iterator j,end;
+  for (i=0;i+4<=n;i+=4)
+  {
+    memcpy(&word,&table[i],sizeof(word));
+    hash=(hash^word)*0x100000001b3;
+  }
+  for (;i<n;i++)
+    hash=(hash^table[i])*0x100000001b3;
+  for (tie(j,end)=scrambleHash.equal_range(hash);j!=end;++j)
+    if (j->second.first==n && memcmp(j->second.second,table,n*sizeof(unsigned short))==0)
+    {
+      arenaUsed-=n;
+      return j->second.second;
+    }
+  scrambleHash.insert(make_pair(hash,make_pair(n,table)));
+  return table;
+}
+
+ScrambleRow::ScrambleRow()
+{
+  table=nullptr;
+  p=0;
+  power=1;
+  scrambletype=QL_SCRAMBLE_NONE;
+}
+
+unsigned ScrambleRow::compute(unsigned limb) const
+{
+  switch (scrambletype)
+  {
+    case QL_SCRAMBLE_POWER:
+      return powerdig(limb,p,power);
+    case QL_SCRAMBLE_FAURE:
+      return faureperm(limb,p);
+    default:
+      return limb;
   }
 }
 
+void quadlods::setComputeScramble(bool compute)
+/* If compute is true, generators set up afterward compute the power and
+ * Faure permutations of digits of primes over 256 as they read out, instead
+ * of storing a table for each prime. For all 6542 primes, the tables take
+ * 400 MB for each scramble type. Tipwitch permutations are always stored,
+ * as they are read from a file.
+ */
+{
+  computeScramble=compute;
+}
+
+void quadlods::setThreads(int n)
+/* Sets how many threads the library uses for work that it splits, such as
+ * computing the Richtmyer fractions of many dimensions. 0 or 1 means that
+ * the calling thread does all of it. The default is one per hardware thread.
+ */
+{
+  threadCount=(n<0)?0:n;
+}
+
+int quadlods::getThreads()
+{
+  return threadCount;
+}
+
 int quadlods::reverseScramble(int limb,int p,int scrambletype)
 {
-  int inx=(scrambletype<<16)+p;
-  fillReverseScrambleTable(p,scrambletype);
-  if (reverseScrambleTable[inx].size())
-    return reverseScrambleTable[inx][limb];
-  else
-    return limb;
+  return reverseScrambleRow(p,scrambletype)[limb];
 }
 
 bool quadlods::incHacc(std::vector<unsigned short> &hacc,int pp,int increment,int pos,bool sign)
@@ -368,22 +788,158 @@ bool quadlods::incHacc(std::vector<unsigned short> &hacc,int pp,int increment,in
   return sign;
 }
 
+void quadlods::radixDigits(unsigned short *digits,const mpz_class &n,int j,int pp,const mpz_class *const *powers)
+/* Writes the 2**j least significant digits of n in base pp to digits,
+ * least significant first, splitting n in half with powers[j-1]=pp**(2**(j-1)).
+ */
+{
+  int i;
+  unsigned long small;
+  mpz_class q,r;
+  if (mpz_fits_ulong_p(n.get_mpz_t()))
+  {
+    small=n.get_ui();
+    for (i=0;i<(1<<j);i++)
+    {
+      digits[i]=small%pp;
+      small/=pp;
+    }
+  }
+  else
+  {
+    mpz_tdiv_qr(q.get_mpz_t(),r.get_mpz_t(),n.get_mpz_t(),powers[j-1]->get_mpz_t());
+    radixDigits(digits,r,j-1,pp,powers);
+    radixDigits(digits+(1<<(j-1)),q,j-1,pp,powers);
+  }
+}
+
 bool quadlods::incHacc(std::vector<unsigned short> &hacc,int pp,mpz_class increment,bool sign)
+/* Adds increment, of any size, to a Halton accumulator. The increment is
+ * converted exactly to base pp by splitting it with powers of pp, which are
+ * computed once for each pp, then added in one pass, carrying.
+ */
 {
-  int ex=0,limb;
-  mpz_class ppex=1;
-  while (fabs(increment.get_d()/ppex.get_d())>2*pp)
+  int i,j,limb,carry=0;
+  bool neg=increment<0;
+  vector<unsigned short> digits;
+  vector<const mpz_class *> powers;
+  if (neg)
+    increment=-increment;
+  {
+    lock_guard<mutex> lock(powerMutex);
+    deque<mpz_class> &pw=ppPowers[pp];
+    if (pw.empty())
+      pw.push_back(pp);
+    for (j=0;pw[j]<=increment;j++)
+    {
+      if (j+1==pw.size())
+	pw.push_back(pw[j]*pw[j]);
+      powers.push_back(&pw[j]);
+    }
+  }
+  digits.resize(1<<j);
+  radixDigits(&digits[0],increment,j,pp,powers.data());
+  while (digits.size() && digits.back()==0)
+    digits.pop_back();
+  while (hacc.size()<digits.size())
+    hacc.push_back(sign?(pp-1):0);
+  for (i=0;i<digits.size() || carry;i++)
   {
-    ex++;
-    ppex*=pp;
+    if (i==hacc.size())
+      hacc.push_back(sign?(pp-1):0);
+    limb=hacc[i]+carry;
+    if (i<digits.size())
+      limb+=neg?-digits[i]:digits[i];
+    carry=0;
+    if (limb>=pp)
+    {
+      carry=1;
+      limb-=pp;
+    }
+    if (limb<0)
+    {
+      carry=-1;
+      limb+=pp;
+    }
+    if (i==hacc.size()-1)
+    {
+      if (carry==1 && sign)
+      {
+	carry=0;
+	sign=false;
+      }
+      if (carry==-1 && !sign)
+      {
+	carry=0;
+	sign=true;
+      }
+    }
+    hacc[i]=limb;
   }
-  while (ex>=0)
+  return sign;
+}
+
+void quadlods::packLimbs(vector<uint64_t> &word,int &len,const vector<unsigned short> &hacc)
+// Packs hacc four limbs to a word, least significant first.
+{
+  int i;
+  len=hacc.size();
+  word.assign((len+3)/4,0);
+  for (i=0;i<len;i++)
+    word[i>>2]|=(uint64_t)hacc[i]<<(16*(i&3));
+}
+
+void quadlods::unpackLimbs(vector<unsigned short> &hacc,const vector<uint64_t> &word,int len)
+{
+  int i;
+  hacc.resize(len);
+  for (i=0;i<len;i++)
+    hacc[i]=(word[i>>2]>>(16*(i&3)))&0xffff;
+}
+
+bool quadlods::incHword(vector<uint64_t> &word,int &len,int pp,int increment,int pos,bool sign)
+/* Same as incHacc, but on limbs packed by packLimbs. Limbs past len in the
+ * last word are 0.
+ */
+{
+  int i,limb,sh;
+  for (i=pos;increment;i++)
   {
-    limb=lrint(increment.get_d()/ppex.get_d());
-    sign=incHacc(hacc,pp,limb,ex,sign);
-    increment-=limb*ppex;
-    ex--;
-    ppex/=pp;
+    while (len<=i)
+    {
+      if ((len&3)==0)
+	word.push_back(0);
+      if (sign)
+	word[len>>2]|=(uint64_t)(pp-1)<<(16*(len&3));
+      len++;
+    }
+    sh=16*(i&3);
+    limb=((word[i>>2]>>sh)&0xffff)+increment;
+    increment=0;
+    while (limb>=pp)
+    {
+      increment++;
+      limb-=pp;
+    }
+    while (limb<0)
+    {
+      increment--;
+      limb+=pp;
+    }
+    if (i==len-1)
+    {
+      if (increment==1 && sign)
+      {
+	increment=0;
+	sign=false;
+      }
+      if (increment==-1 && !sign)
+      {
+	increment=0;
+	sign=true;
+      }
+    }
+    word[i>>2]=(word[i>>2]&~((uint64_t)0xffff<<sh))|((uint64_t)limb<<sh);
   }
   return sign;
 }
@@ -398,120 +954,710 @@ mpz_class quadlods::haccValue(vector<unsigned short> &hacc,int pp,bool sign)
 }
 
 mpq_class quadlods::haccReverseScramble(vector<unsigned short> &hacc,int p,int scrambletype,bool sign)
+{
+  return haccReadout(hacc,primePower(p)[1],reverseScrambleRow(p,scrambletype),sign);
+}
+
+mpq_class quadlods::haccReadout(const vector<unsigned short> &hacc,int pp,const ScrambleRow &row,bool sign)
+// Reverses hacc, reverse scrambling each limb with row.
 {
   mpz_class num=0,denom=1;
-  int i,pp=primePower(p)[1];
+  int i;
   for (i=0;i<hacc.size();i++)
   {
-    num=num*pp+reverseScramble(hacc[i],p,scrambletype);
+    num=num*pp+row[hacc[i]];
     denom*=pp;
   }
   return mpq_class(num+sign,denom);
 }
 
-mpz_class quadlods::thuemorse(int n)
+uint64_t quadlods::haccScale(const vector<unsigned short> &hacc,int pp,const ScrambleRow &row,bool sign,uint64_t m)
+/* Returns haccReadout times m, rounded down, where m=0 means 2**64.
+ * Working from the least significant limb, floor(m*(d+t)/pp), where
+ * t<=1 is the part below limb d, is floor((m*d+floor(m*t))/pp), so
+ * no bigger numbers are needed. A readout of 1 returns m-1.
+ */
+{
+  int i;
+  unsigned __int128 mm=m?m:(unsigned __int128)1<<64,ret=sign?mm:0;
+  for (i=hacc.size()-1;i>=0;i--)
+    ret=(mm*row[hacc[i]]+ret)/pp;
+  if (ret>=mm)
+    ret=mm-1;
+  return ret;
+}
+
+const unsigned short *quadlods::findReverseScrambleRow(int p,int scrambletype)
+/* Returns the reverse scramble table for p, or null if limbs are not
+ * scrambled or the table hasn't been filled. Call with tableMutex held.
+ */
+{
+  map<unsigned,const unsigned short *>::const_iterator j;
+  j=reverseScrambleTable.find((scrambletype<<16)+p);
+  if (j!=reverseScrambleTable.end())
+    return j->second;
+  else
+    return nullptr;
+}
+
+ScrambleRow quadlods::reverseScrambleRow(int p,int scrambletype)
+/* Returns the reverse scrambler for p, which points to a table unless
+ * limbs are not scrambled or the permutation is computed. The table does
+ * not move once filled.
+ */
 {
-  while (morse<=n)
+  ScrambleRow ret;
+  if (computeScramble && p>256 &&
+      (scrambletype==QL_SCRAMBLE_POWER || scrambletype==QL_SCRAMBLE_FAURE))
+  {
+    ret.p=p;
+    ret.scrambletype=scrambletype;
+    if (scrambletype==QL_SCRAMBLE_POWER)
+      ret.power=relprime(p-1);
+  }
+  else
   {
-    thue+=(mpz_class)(((thue&((mpz_class)1<<(morse>>5)))>0)?(unsigned)0x96696996:0x69969669)<<morse;
-    morse+=32;
+    fillReverseScrambleTable(p,scrambletype);
+    lock_guard<mutex> lock(tableMutex);
+    ret.table=findReverseScrambleRow(p,scrambletype);
   }
-  return thue&(((mpz_class)1<<n)-1);
+  return ret;
+}
+
+unsigned __int128 quadlods::truncate53(unsigned __int128 x)
+// Clears all but the 53 most significant bits of x.
+{
+  int b=0;
+  if (x>>64)
+    b=128-__builtin_clzll((uint64_t)(x>>64));
+  else if (x)
+    b=64-__builtin_clzll((uint64_t)x);
+  if (b>53)
+    x=(x>>(b-53))<<(b-53);
+  return x;
 }
 
-mpz_class quadlods::minusthird(int n)
+double quadlods::fixedToDouble(unsigned __int128 x)
+/* Converts x/2**128 to double, truncating toward zero like mpq_get_d.
+ * The exponent is put together by hand, since ldexp is slow.
+ */
 {
-  while (b2adic<=n)
+  int b=0;
+  uint64_t bits;
+  double ret;
+  if (x>>64)
+    b=128-__builtin_clzll((uint64_t)(x>>64));
+  else if (x)
+    b=64-__builtin_clzll((uint64_t)x);
+  if (b>53)
   {
-    third+=(mpz_class)0x55555555<<b2adic;
-    b2adic+=32;
+    bits=((uint64_t)(b+894)<<52)|((uint64_t)(x>>(b-53))&0xfffffffffffff);
+    memcpy(&ret,&bits,sizeof(ret));
+    return ret;
   }
-  return third&(((mpz_class)1<<n)-1);
+  else
+    return ldexp((uint64_t)x,-128);
 }
 
-mpz_class quadlods::graydecode(mpz_class n)
+double quadlods::haccDouble(vector<unsigned short> &frac,const vector<uint64_t> &word,int len,int pp,const ScrambleRow &row,bool sign)
+/* Returns the packed Halton accumulator, reversed and reverse scrambled with
+ * row, as a double truncated toward zero like mpq_get_d, without GMP.
+ * The limbs, copied to frac, are a fraction in base pp, which is multiplied
+ * by 2**16 at a time, taking 16 bits off the top, until 53 significant bits
+ * are known or the rest of the fraction is 0.
+ */
 {
-  int i;
-  i=mpz_sizeinbase(n.get_mpz_t(),2);
-  while (i&(i-1))
-    i+=i&-i;
-  while (i)
+  int k,ex=0;
+  bool more=false;
+  uint64_t carry;
+  unsigned __int128 mant=0;
+  frac.resize(len);
+  for (k=0;k<len;k++)
+    frac[k]=row[(word[k>>2]>>(16*(k&3)))&0xffff];
+  carry=sign;
+  for (k=len-1;carry && k>=0;k--)
+  {
+    carry+=frac[k];
+    frac[k]=carry%pp;
+    carry/=pp;
+  }
+  if (carry)
+    return 1;
+  for (k=0;k<len;k++)
+    more|=frac[k]!=0;
+  while (more && mant<((unsigned __int128)1<<52))
   {
-    n^=n>>i;
-    i/=2;
+    more=false;
+    carry=0;
+    for (k=len-1;k>=0;k--)
+    {
+      carry+=(uint64_t)frac[k]<<16;
+      frac[k]=carry%pp;
+      carry/=pp;
+      more|=frac[k]!=0;
+    }
+    mant=(mant<<16)|carry;
+    ex-=16;
   }
-  return n;
+  return ldexp((double)truncate53(mant),ex);
+}
+
+mpz_class quadlods::thueMorseBits(int n)
+// Returns more than n bits of the Thue-Morse sequence.
+{
+  mpz_class ret(0x69969669);
+  int i;
+  for (i=32;i<=n;i+=32)
+    ret+=(mpz_class)(((ret&((mpz_class)1<<(i>>5)))>0)?(unsigned)0x96696996:0x69969669)<<i;
+  return ret;
 }
 
-mpz_class quadlods::scramble(mpz_class acc,mpz_class denom,int scrambletype)
+mpz_class quadlods::thirdBits(int n)
+// Returns more than n bits of -1/3 in 2-adic.
 {
+  mpz_class ret(0x55555555);
   int i;
-  mpz_class bitdiff,hibits,lobits,ret;
-  bitdiff=denom&~acc;
-  i=mpz_sizeinbase(bitdiff.get_mpz_t(),2)-1;
+  for (i=32;i<=n;i+=32)
+    ret+=(mpz_class)0x55555555<<i;
+  return ret;
+}
+
+void quadlods::scrambleMpz(mpz_t ret,const mpz_t acc,const mpz_t denom,int scrambletype,mpz_t tmp0,mpz_t tmp1)
+/* Sets ret to acc scrambled, using tmp0 and tmp1 as scratch, so that once
+ * they and ret are big enough, nothing is allocated. The bits below the
+ * highest bit where denom is 1 and acc is 0 are xored with -1/3 or the
+ * Thue-Morse word, or Gray decoded by xoring with shifts of 2**k bits.
+ * ret may be acc.
+ */
+{
+  int i,sh;
+  mpz_com(tmp0,acc);
+  mpz_and(tmp0,tmp0,denom);
+  i=mpz_sizeinbase(tmp0,2)-1;
   switch (scrambletype)
   {
     case QL_SCRAMBLE_THIRD:
-      ret=acc^minusthird(i);
+      if (i<scrambleBits)
+	mpz_tdiv_r_2exp(tmp0,third.get_mpz_t(),i);
+      else
+	mpz_tdiv_r_2exp(tmp0,thirdBits(i).get_mpz_t(),i);
+      mpz_xor(ret,acc,tmp0);
       break;
     case QL_SCRAMBLE_THUEMORSE:
-      ret=acc^thuemorse(i);
+      if (i<scrambleBits)
+	mpz_tdiv_r_2exp(tmp0,thue.get_mpz_t(),i);
+      else
+	mpz_tdiv_r_2exp(tmp0,thueMorseBits(i).get_mpz_t(),i);
+      mpz_xor(ret,acc,tmp0);
       break;
     case QL_SCRAMBLE_GRAY:
-      lobits=acc&(((mpz_class)1<<i)-1);
-      hibits=acc-lobits;
-      ret=hibits+graydecode(lobits);
+      mpz_tdiv_r_2exp(tmp0,acc,i);
+      sh=mpz_sizeinbase(tmp0,2);
+      while (sh&(sh-1))
+	sh+=sh&-sh;
+      for (;sh;sh/=2)
+      {
+	mpz_tdiv_q_2exp(tmp1,tmp0,sh);
+	mpz_xor(tmp0,tmp0,tmp1);
+      }
+      mpz_tdiv_q_2exp(ret,acc,i);
+      mpz_mul_2exp(ret,ret,i);
+      mpz_ior(ret,ret,tmp0);
       break;
     default:
-      ret=acc;
+      mpz_set(ret,acc);
   }
+}
+
+mpz_class quadlods::scramble(const mpz_class &acc,const mpz_class &denom,int scrambletype)
+{
+  mpz_class ret,tmp0,tmp1;
+  scrambleMpz(ret.get_mpz_t(),acc.get_mpz_t(),denom.get_mpz_t(),scrambletype,tmp0.get_mpz_t(),tmp1.get_mpz_t());
   return ret;
 }
 
-void quadlods::initprimes()
+void quadlods::mpzToLimbs(uint64_t *limbs,const mpz_class &n,int nlimbs)
+// n must be nonnegative and fit in nlimbs limbs.
 {
-  int i,j,n;
-  int primeCheck=0,filePos=0,filePos1=0;
-  bool prime;
-  PrimeContinuedFraction pcf;
-  ifstream primeFile(string(SHARE_DIR)+"/primes.dat",ios::binary);
-  primes.clear();
-  for (i=2;i<65535;i++)
-  {
-    for (j=0,prime=true;j<primes.size() && prime && (unsigned int)primes[j]*primes[j]<=i;j++)
-      if (i%primes[j]==0)
-	prime=false;
-    if (prime)
-    {
-      primeCheck+=i;
-      primes.push_back(i);
-      if (i<4)
-      {
-	scrambleFileIndex[i]=-1;
-	permuteFileIndex[i]=-1;
-      }
-      else
-      {
-	scrambleFileIndex[i]=filePos;
-	permuteFileIndex[i]=filePos1;
-	filePos+=i-1;
-	filePos1+=(i-2)*2+primes.size()-2;
-      }
-    }
-  }
-  /* The scramble file is 250 times bigger than the prime file, so it's
-   * not loaded, but read when setting up a Halton generator.
-   */
-  primesCfSorted.clear();
-  for (i=0;i<QL_MAX_DIMS;i++)
+  size_t count;
+  int i;
+  mpz_export(limbs,&count,-1,8,0,0,n.get_mpz_t());
+  for (i=count;i<nlimbs;i++)
+    limbs[i]=0;
+}
+
+mpz_class quadlods::limbsToMpz(const uint64_t *limbs,int nlimbs)
+{
+  mpz_class ret;
+  mpz_import(ret.get_mpz_t(),nlimbs,-1,8,0,0,limbs);
+  return ret;
+}
+
+template<int N> int quadlods::bitLength(const uint64_t *a)
+{
+  int i;
+  for (i=N-1;i>=0;i--)
+    if (a[i])
+      return 64*i+64-__builtin_clzll(a[i]);
+  return 0;
+}
+
+template<int N> int quadlods::compareLimbs(const uint64_t *a,const uint64_t *b)
+{
+  int i;
+  for (i=N-1;i>=0;i--)
+    if (a[i]!=b[i])
+      return (a[i]>b[i])?1:-1;
+  return 0;
+}
+
+template<int N> void quadlods::subLimbs(uint64_t *a,const uint64_t *b)
+{
+  int i;
+  uint64_t d;
+  bool borrow=false;
+  for (i=0;i<N;i++)
+  {
+    d=a[i]-b[i]-borrow;
+    borrow=borrow?(a[i]<=b[i]):(a[i]<b[i]);
+    a[i]=d;
+  }
+}
+
+template<int N> void quadlods::shiftLeftLimbs(uint64_t *a,int n)
+// Bits shifted out of the top limb are lost.
+{
+  int i,w=n/64,b=n%64;
+  for (i=N-1;i>=0;i--)
+    a[i]=((i>=w)?(a[i-w]<<b):0)|((b && i>w)?(a[i-w-1]>>(64-b)):0);
+}
+
+template<int N> void quadlods::mulLimbs(uint64_t *ret,const uint64_t *a,uint64_t m)
+// ret has N+1 limbs.
+{
+  int i;
+  unsigned __int128 prod=0;
+  for (i=0;i<N;i++)
+  {
+    prod+=(unsigned __int128)a[i]*m;
+    ret[i]=prod;
+    prod>>=64;
+  }
+  ret[N]=prod;
+}
+
+template<int N> void quadlods::addmodLimbs(uint64_t *acc,const uint64_t *num,const uint64_t *denom)
+/* Adds num to acc mod denom. Both acc and num must be less than denom.
+ * If denom is more than half the limb range, the sum can overflow N limbs,
+ * in which case it is certainly at least denom.
+ */
+{
+  int i;
+  bool carry=false;
+  uint64_t sum;
+  for (i=0;i<N;i++)
+  {
+    sum=acc[i]+num[i]+carry;
+    carry=carry?(sum<=acc[i]):(sum<acc[i]);
+    acc[i]=sum;
+  }
+  if (carry || compareLimbs<N>(acc,denom)>=0)
+    subLimbs<N>(acc,denom);
+}
+
+template<int N> void quadlods::scrambleLimbs(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int scrambletype)
+/* Same as scramble, but on limbs. Since the denominator is at most 256 bits,
+ * the Thue-Morse and third masks are constants. Gray decoding is a prefix xor
+ * within each limb, then complementing each limb if the bits above it
+ * have odd parity.
+ */
+{
+  int i,j,k;
+  uint64_t bitdiff[N],mask,lo;
+  bool parity=false;
+  for (j=0;j<N;j++)
+    bitdiff[j]=denom[j]&~acc[j];
+  i=bitLength<N>(bitdiff)-1;
+  if (i<0)
+    i=0;
+  for (j=N-1;j>=0;j--)
+  {
+    if (64*j>=i)
+      mask=0;
+    else if (64*j+64<=i)
+      mask=~(uint64_t)0;
+    else
+      mask=((uint64_t)1<<(i-64*j))-1;
+    switch (scrambletype)
+    {
+      case QL_SCRAMBLE_THIRD:
+	ret[j]=acc[j]^(thirdWord&mask);
+	break;
+      case QL_SCRAMBLE_THUEMORSE:
+	ret[j]=acc[j]^(thueWords[j]&mask);
+	break;
+      case QL_SCRAMBLE_GRAY:
+	lo=acc[j]&mask;
+	ret[j]=lo;
+	for (k=1;k<64;k*=2)
+	  ret[j]^=ret[j]>>k;
+	if (parity)
+	  ret[j]=~ret[j]&mask;
+	parity^=__builtin_parityll(lo);
+	ret[j]|=acc[j]&~mask;
+	break;
+      default:
+	ret[j]=acc[j];
+    }
+  }
+}
+
+template<int N> double quadlods::limbsReadout(const uint64_t *s,const uint64_t *denom)
+/* Returns (2s+1)/(2denom) as a double, truncated toward zero like
+ * mpq_get_d, so that the result is the same as with mpq_class.
+ * The numerator x is shifted so that the 53-bit quotient q=floor(x/y)
+ * has its top bit set. q is estimated from the top 64 bits of y, which is
+ * off by at most 2, then corrected by multiplying back.
+ */
+{
+  int i,e,k;
+  uint64_t x[N+2],y[N+2],prod[N+2],yh;
+  unsigned __int128 xh;
+  uint64_t q;
+  x[N+1]=y[N+1]=0;
+  x[N]=s[N-1]>>63;
+  y[N]=denom[N-1]>>63;
+  for (i=N-1;i>0;i--)
+  {
+    x[i]=(s[i]<<1)|(s[i-1]>>63);
+    y[i]=(denom[i]<<1)|(denom[i-1]>>63);
+  }
+  x[0]=(s[0]<<1)|1;
+  y[0]=denom[0]<<1;
+  e=bitLength<N+1>(y)-bitLength<N+1>(x);
+  if constexpr (N==1)
+  {
+    unsigned __int128 x128=((unsigned __int128)x[1]<<64)+x[0];
+    unsigned __int128 y128=((unsigned __int128)y[1]<<64)+y[0];
+    if ((x128<<e)<y128)
+      e++;
+    q=(x128<<(e+52))/y128;
+  }
+  else
+  {
+    shiftLeftLimbs<N+2>(x,e);
+    if (compareLimbs<N+2>(x,y)<0)
+    {
+      shiftLeftLimbs<N+2>(x,1);
+      e++;
+    }
+    shiftLeftLimbs<N+2>(x,52);
+    /* A denominator under 2**63 can share a width with wider ones. Then y
+     * fits in one limb, yh is all of it, and q is exact.
+     */
+    k=bitLength<N+1>(y)-64;
+    if (k<0)
+      k=0;
+    yh=(y[k/64]>>(k%64))|((k%64)?(y[k/64+1]<<(64-k%64)):0);
+    xh=x[k/64+2]>>(k%64);
+    xh=(xh<<64)|(x[k/64+1]>>(k%64))|((k%64)?(x[k/64+2]<<(64-k%64)):0);
+    xh=(xh<<64)|(x[k/64]>>(k%64))|((k%64)?(x[k/64+1]<<(64-k%64)):0);
+    q=xh/yh;
+    mulLimbs<N+1>(prod,y,q);
+    while (compareLimbs<N+2>(prod,x)>0)
+    {
+      q--;
+      subLimbs<N+2>(prod,y);
+    }
+    subLimbs<N+2>(x,prod);
+    while (compareLimbs<N+2>(x,y)>=0)
+    {
+      q++;
+      subLimbs<N+2>(x,y);
+    }
+  }
+  return ldexp(q,-(e+52));
+}
+
+template<int N> uint64_t quadlods::limbsScale(const uint64_t *s,const uint64_t *denom,uint64_t m)
+/* Returns (2s+1)/(2denom) times m, rounded down, where m=0 means 2**64.
+ * The quotient of x=(2s+1)m by y=2denom is less than 2**64. It is
+ * estimated from the top 64 bits of y, then corrected as in limbsReadout.
+ */
+{
+  int i,k,w,b;
+  uint64_t x[N+2],y[N+2],odd[N+1],prod[N+2],yh;
+  unsigned __int128 xh,q;
+  y[N+1]=0;
+  y[N]=denom[N-1]>>63;
+  odd[N]=s[N-1]>>63;
+  for (i=N-1;i>0;i--)
+  {
+    y[i]=(denom[i]<<1)|(denom[i-1]>>63);
+    odd[i]=(s[i]<<1)|(s[i-1]>>63);
+  }
+  y[0]=denom[0]<<1;
+  odd[0]=(s[0]<<1)|1;
+  if (m)
+    mulLimbs<N+1>(x,odd,m);
+  else
+  {
+    x[0]=0;
+    for (i=0;i<=N;i++)
+      x[i+1]=odd[i];
+  }
+  k=bitLength<N+2>(y)-64;
+  if (k<0)
+    k=0;
+  w=k/64;
+  b=k%64;
+  yh=(y[w]>>b)|(b?(y[w+1]<<(64-b)):0);
+  xh=(x[w+1]>>b)|(b?(x[w+2]<<(64-b)):0);
+  xh=(xh<<64)|(x[w]>>b)|(b?(x[w+1]<<(64-b)):0);
+  q=xh/yh;
+  if (q>~(uint64_t)0)
+    q=~(uint64_t)0;
+  mulLimbs<N+1>(prod,y,q);
+  while (compareLimbs<N+2>(prod,x)>0)
+  {
+    q--;
+    subLimbs<N+2>(prod,y);
+  }
+  subLimbs<N+2>(x,prod);
+  while (compareLimbs<N+2>(x,y)>=0)
+  {
+    q++;
+    subLimbs<N+2>(x,y);
+  }
+  return q;
+}
+
+void quadlods::addmodBlockScalar(uint64_t *acc,const uint64_t *num,const uint64_t *denom,int n)
+// Steps n one-limb accumulators.
+{
+  int i;
+  for (i=0;i<n;i++)
+    addmodLimbs<1>(acc+i,num+i,denom+i);
+}
+
+void quadlods::scrambleBlockScalar(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int n,int scrambletype)
+{
+  int i;
+  for (i=0;i<n;i++)
+    scrambleLimbs<1>(ret+i,acc+i,denom+i,scrambletype);
+}
+
+#ifdef QL_X86_SIMD
+/* The vector kernels do four (AVX2) or eight (AVX-512) one-limb dimensions
+ * at once, then finish the remainder with the scalar kernel. The scrambling
+ * mask, which covers the bits below the highest bit where denom has 1 and
+ * acc has 0, is made by smearing that bit rightward (AVX2) or by counting
+ * leading zeros (AVX-512). Gray decoding is a prefix xor by shifting.
+ */
+__attribute__((target("avx2")))
+void quadlods::addmodBlockAvx2(uint64_t *acc,const uint64_t *num,const uint64_t *denom,int n)
+{
+  int i;
+  __m256i a,b,d,sum,carry,geq;
+  const __m256i bias=_mm256_set1_epi64x(0x8000000000000000);
+  for (i=0;i+4<=n;i+=4)
+  {
+    a=_mm256_loadu_si256((const __m256i *)(acc+i));
+    b=_mm256_loadu_si256((const __m256i *)(num+i));
+    d=_mm256_loadu_si256((const __m256i *)(denom+i));
+    sum=_mm256_add_epi64(a,b);
+    // Unsigned comparisons, done by flipping the sign bits.
+    carry=_mm256_cmpgt_epi64(_mm256_xor_si256(a,bias),_mm256_xor_si256(sum,bias));
+    geq=_mm256_cmpgt_epi64(_mm256_xor_si256(d,bias),_mm256_xor_si256(sum,bias));
+    geq=_mm256_or_si256(carry,_mm256_xor_si256(geq,_mm256_set1_epi64x(-1)));
+    sum=_mm256_sub_epi64(sum,_mm256_and_si256(geq,d));
+    _mm256_storeu_si256((__m256i *)(acc+i),sum);
+  }
+  addmodBlockScalar(acc+i,num+i,denom+i,n-i);
+}
+
+__attribute__((target("avx2")))
+void quadlods::scrambleBlockAvx2(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int n,int scrambletype)
+{
+  int i,k;
+  __m256i a,d,mask,lo;
+  for (i=0;i+4<=n;i+=4)
+  {
+    a=_mm256_loadu_si256((const __m256i *)(acc+i));
+    d=_mm256_loadu_si256((const __m256i *)(denom+i));
+    mask=_mm256_andnot_si256(a,d);
+    for (k=1;k<64;k*=2)
+      mask=_mm256_or_si256(mask,_mm256_srli_epi64(mask,k));
+    mask=_mm256_srli_epi64(mask,1);
+    switch (scrambletype)
+    {
+      case QL_SCRAMBLE_THIRD:
+	a=_mm256_xor_si256(a,_mm256_and_si256(mask,_mm256_set1_epi64x(thirdWord)));
+	break;
+      case QL_SCRAMBLE_THUEMORSE:
+	a=_mm256_xor_si256(a,_mm256_and_si256(mask,_mm256_set1_epi64x(thueWords[0])));
+	break;
+      case QL_SCRAMBLE_GRAY:
+	lo=_mm256_and_si256(a,mask);
+	for (k=1;k<64;k*=2)
+	  lo=_mm256_xor_si256(lo,_mm256_srli_epi64(lo,k));
+	a=_mm256_or_si256(_mm256_andnot_si256(mask,a),lo);
+	break;
+    }
+    _mm256_storeu_si256((__m256i *)(ret+i),a);
+  }
+  scrambleBlockScalar(ret+i,acc+i,denom+i,n-i,scrambletype);
+}
+
+__attribute__((target("avx512f")))
+void quadlods::addmodBlockAvx512(uint64_t *acc,const uint64_t *num,const uint64_t *denom,int n)
+{
+  int i;
+  __m512i a,b,d,sum;
+  __mmask8 geq;
+  for (i=0;i+8<=n;i+=8)
   {
-    pcf.prime=(unsigned short)readshort(primeFile);
+    a=_mm512_loadu_si512(acc+i);
+    b=_mm512_loadu_si512(num+i);
+    d=_mm512_loadu_si512(denom+i);
+    sum=_mm512_add_epi64(a,b);
+    geq=_mm512_cmplt_epu64_mask(sum,a)|_mm512_cmpge_epu64_mask(sum,d);
+    sum=_mm512_mask_sub_epi64(sum,geq,sum,d);
+    _mm512_storeu_si512(acc+i,sum);
+  }
+  addmodBlockScalar(acc+i,num+i,denom+i,n-i);
+}
+
+__attribute__((target("avx512f,avx512cd")))
+void quadlods::scrambleBlockAvx512(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int n,int scrambletype)
+{
+  int i,k;
+  __m512i a,d,mask,lo;
+  for (i=0;i+8<=n;i+=8)
+  {
+    a=_mm512_loadu_si512(acc+i);
+    d=_mm512_loadu_si512(denom+i);
+    // Shifting right by 64 or more gives 0, which is right when denom==acc.
+    mask=_mm512_srlv_epi64(_mm512_set1_epi64(-1),
+			   _mm512_add_epi64(_mm512_lzcnt_epi64(_mm512_andnot_si512(a,d)),
+					    _mm512_set1_epi64(1)));
+    switch (scrambletype)
+    {
+      case QL_SCRAMBLE_THIRD:
+	a=_mm512_xor_si512(a,_mm512_and_si512(mask,_mm512_set1_epi64(thirdWord)));
+	break;
+      case QL_SCRAMBLE_THUEMORSE:
+	a=_mm512_xor_si512(a,_mm512_and_si512(mask,_mm512_set1_epi64(thueWords[0])));
+	break;
+      case QL_SCRAMBLE_GRAY:
+	lo=_mm512_and_si512(a,mask);
+	for (k=1;k<64;k*=2)
+	  lo=_mm512_xor_si512(lo,_mm512_srli_epi64(lo,k));
+	a=_mm512_or_si512(_mm512_andnot_si512(mask,a),lo);
+	break;
+    }
+    _mm512_storeu_si512(ret+i,a);
+  }
+  scrambleBlockScalar(ret+i,acc+i,denom+i,n-i,scrambletype);
+}
+#endif
+
+int quadlods::cpuSimd()
+{
+#ifdef QL_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd"))
+    return QL_SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return QL_SIMD_AVX2;
+#endif
+  return QL_SIMD_NONE;
+}
+
+int quadlods::setSimd(int level)
+/* Limits the vector kernels to level, which is mostly useful for testing,
+ * and returns the level actually used, which is also limited by the CPU.
+ */
+{
+  int cpu=cpuSimd();
+  if (level>cpu)
+    level=cpu;
+  simdLevel=level;
+  return level;
+}
+
+int quadlods::getSimd()
+{
+  return simdLevel;
+}
+
+void quadlods::addmodBlock(uint64_t *acc,const uint64_t *num,const uint64_t *denom,int n)
+{
+  switch (simdLevel)
+  {
+#ifdef QL_X86_SIMD
+    case QL_SIMD_AVX512:
+      addmodBlockAvx512(acc,num,denom,n);
+      break;
+    case QL_SIMD_AVX2:
+      addmodBlockAvx2(acc,num,denom,n);
+      break;
+#endif
+    default:
+      addmodBlockScalar(acc,num,denom,n);
+  }
+}
+
+void quadlods::scrambleBlock(uint64_t *ret,const uint64_t *acc,const uint64_t *denom,int n,int scrambletype)
+{
+  switch (simdLevel)
+  {
+#ifdef QL_X86_SIMD
+    case QL_SIMD_AVX512:
+      scrambleBlockAvx512(ret,acc,denom,n,scrambletype);
+      break;
+    case QL_SIMD_AVX2:
+      scrambleBlockAvx2(ret,acc,denom,n,scrambletype);
+      break;
+#endif
+    default:
+      scrambleBlockScalar(ret,acc,denom,n,scrambletype);
+  }
+}
+
+void quadlods::initprimes()
+/* Reads the primes sorted by continued fraction from primes.dat, or from
+ * the copy built into the library.
+ * The scramble file is 250 times bigger than the prime file, so it's
+ * not decoded here, but mapped and decoded a row at a time when setting
+ * up a Halton generator.
+ */
+{
+  int i,j,n;
+  int primeCheck=0;
+  PrimeContinuedFraction pcf;
+  MappedFile primeFile;
+  const unsigned char *ptr,*end;
+#ifdef QL_EMBED_DATA
+  ptr=quadlodsPrimesData;
+  end=quadlodsPrimesEnd;
+#else
+  primeFile.open(string(SHARE_DIR)+"/primes.dat");
+  ptr=primeFile.data;
+  end=ptr+primeFile.size;
+#endif
+  for (i=0;i<QL_MAX_DIMS;i++)
+    primeCheck+=primes[i];
+  primesCfSorted.clear();
+  for (i=0;i<QL_MAX_DIMS;i++)
+  {
+    pcf.prime=(unsigned short)readshort(ptr,end);
     primeCheck-=pcf.prime;
-    n=readshort(primeFile);
-    pcf.cf.period=readshort(primeFile);
+    n=readshort(ptr,end);
+    pcf.cf.period=readshort(ptr,end);
     pcf.cf.terms.clear();
     for (j=0;j<n;j++)
-      pcf.cf.terms.push_back(readshort(primeFile));
+      pcf.cf.terms.push_back(readshort(ptr,end));
     primesCfSorted.push_back(pcf);
   }
   if (primeCheck)
@@ -519,6 +1665,26 @@ void quadlods::initprimes()
     cerr<<"Prime file is corrupt or failed to load"<<endl;
     primesCfSorted.clear();
   }
+  primeIndexTable.assign(65536,-1);
+  for (i=0;i<QL_MAX_DIMS;i++)
+    primeIndexTable[primesCfSorted.size()?primesCfSorted[i].prime:primes[i]]=i;
+}
+
+void quadlods::initquads()
+{
+  int i;
+  mpz_class nmid,dmid;
+  quadTable.resize(2*QL_MAX_DIMS);
+  for (i=0;i<QL_MAX_DIMS;i++)
+  {
+    if (primesCfSorted.size())
+      compquad(primesCfSorted[i].cf,27/DBL_EPSILON,nmid,dmid);
+    else
+      compquad(nthprime(i),27/DBL_EPSILON,nmid,dmid);
+    quadTable[2*i]=mpq_class(nmid,dmid).get_d();
+    nmid%=dmid;
+    quadTable[2*i+1]=mpq_class(nmid,dmid).get_d();
+  }
 }
 
 void quadlods::compquad(int p,double resolution,mpz_class &nmid,mpz_class &dmid)
@@ -547,28 +1713,40 @@ void quadlods::compquad(int p,double resolution,mpz_class &nmid,mpz_class &dmid)
 }
 
 void quadlods::compquad(ContinuedFraction cf,double resolution,mpz_class &nmid,mpz_class &dmid)
+/* Goes down the Stern-Brocot tree toward the number whose continued
+ * fraction is cf, stopping at the first mediant whose denominator is at
+ * least resolution. Each term of cf is a run of steps that add the same
+ * fraction to the same bound, so this goes to the end of the run at once,
+ * or to the step in the middle of it whose denominator is big enough.
+ */
 {
-  mpz_class nhi,dhi,nlo,dlo;
-  int i=0,j=0;
+  mpz_class nhi,dhi,nlo,dlo,need,steps;
+  int i=0,run;
   bool comp=false;
+  need=ceil(resolution);
   for (nhi=dlo=1,nlo=dhi=dmid=0;dmid<resolution;)
   {
-    dmid=dhi+dlo;
-    nmid=nhi+nlo;
-    if (comp>0)
-    {
-      dhi=dmid;
-      nhi=nmid;
-    }
-    else
+    mpz_class &nbound=comp?nhi:nlo,&dbound=comp?dhi:dlo;
+    mpz_class &nstep=comp?nlo:nhi,&dstep=comp?dlo:dhi;
+    run=max(cf.terms[i],1);
+    steps=run;
+    if (dstep>0)
     {
-      dlo=dmid;
-      nlo=nmid;
+      mpz_cdiv_q(steps.get_mpz_t(),mpz_class(need-dbound).get_mpz_t(),dstep.get_mpz_t());
+      if (steps<1)
+	steps=1;
+      if (steps>run)
+	steps=run;
     }
-    if (++j>=cf.terms[i])
+    else if (dbound>=need)
+      steps=1;
+    nbound+=steps*nstep;
+    dbound+=steps*dstep;
+    nmid=nbound;
+    dmid=dbound;
+    if (steps==run)
     {
       comp=!comp;
-      j=0;
       if (++i>=cf.terms.size())
 	i-=cf.period;
     }
@@ -578,8 +1756,7 @@ void quadlods::compquad(ContinuedFraction cf,double resolution,mpz_class &nmid,m
 
 int quadlods::nthprime(int n)
 {
-  if (primes.size()==0)
-    initprimes();
+  call_once(primesOnce,initprimes);
   if (n<0 || n>=primes.size())
     return 0;
   else if (primesCfSorted.size())
@@ -588,23 +1765,24 @@ int quadlods::nthprime(int n)
     return primes[n];
 }
 
+int quadlods::primeIndex(int p)
+// Returns n such that nthprime(n)==p, or -1 if p is not one of them.
+{
+  call_once(primesOnce,initprimes);
+  if (p<0 || p>=primeIndexTable.size())
+    return -1;
+  else
+    return primeIndexTable[p];
+}
+
 double quadlods::nthquad(int n,bool mod1)
 {
-  mpz_class nmid,dmid;
+  call_once(primesOnce,initprimes);
+  call_once(quadOnce,initquads);
   if (n<0 || n>=primes.size())
     return NAN;
   else
-  {
-    if (primesCfSorted.size())
-      compquad(primesCfSorted[n].cf,27/DBL_EPSILON,nmid,dmid);
-    else
-    {
-      compquad(nthprime(n),27/DBL_EPSILON,nmid,dmid);
-    }
-    if (mod1)
-      nmid%=dmid;
-    return mpq_class(nmid,dmid).get_d();
-  }
+    return quadTable[2*n+mod1];
 }
 
 double ContinuedFraction::averageTerm() const
@@ -628,281 +1806,951 @@ double ContinuedFraction::averageTerm() const
   }
 }
 
-int ContinuedFraction::maximumTerm() const
+int ContinuedFraction::maximumTerm() const
+{
+  int i,max=0;
+  for (i=0;i<period && i<terms.size();i++)
+    if (max<terms[terms.size()-i-1])
+      max=terms[terms.size()-i-1];
+  return max;
+}
+
+bool operator<(const PrimeContinuedFraction &a,const PrimeContinuedFraction &b)
+{
+  double aavg=a.cf.averageTerm(),bavg=b.cf.averageTerm();
+  int amax=a.cf.maximumTerm(),bmax=b.cf.maximumTerm();
+  if (amax!=bmax)
+    return amax<bmax;
+  else if (fabs(aavg-bavg)>1e-10)
+    return aavg<bavg;
+  else
+    return a.prime<b.prime;
+}
+
+SequenceSpec::SequenceSpec()
+{
+  mode=QL_MODE_RICHTMYER;
+  scrambletype=QL_SCRAMBLE_NONE;
+  limbs=0;
+  stride=1;
+}
+
+shared_ptr<const SequenceSpec> quadlods::emptySpec()
+// The spec of a generator with no dimensions, shared by all of them.
+{
+  static shared_ptr<const SequenceSpec> ret=make_shared<SequenceSpec>();
+  return ret;
+}
+
+shared_ptr<const SequenceSpec> quadlods::cachedSpec(const SequenceSpec &s,double resolution)
+/* Returns a spec built the same way as s will be, or null. Only the mode,
+ * primes, scrambling, and stride of s need to be set.
+ */
+{
+  lock_guard<mutex> lock(specMutex);
+  auto it=specCache.find(SpecKey(s.mode,s.primeinx,resolution,s.scrambletype,s.stride));
+  if (it==specCache.end())
+    return nullptr;
+  return it->second.lock();
+}
+
+void quadlods::cacheSpec(shared_ptr<const SequenceSpec> s,double resolution)
+// Also drops the specs that no generator holds any more.
+{
+  map<SpecKey,weak_ptr<const SequenceSpec> >::iterator it;
+  lock_guard<mutex> lock(specMutex);
+  for (it=specCache.begin();it!=specCache.end();)
+    if (it->second.expired())
+      it=specCache.erase(it);
+    else
+      ++it;
+  specCache[SpecKey(s->mode,s->primeinx,resolution,s->scrambletype,s->stride)]=s;
+}
+
+Quadlods::Quadlods()
+{
+  spec=emptySpec();
+  sign=false;
+  hscram=-1;
+}
+
+Quadlods::Quadlods(shared_ptr<const SequenceSpec> s)
+{
+  spec=s;
+  sign=false;
+  hscram=-1;
+  if (spec->mode==QL_MODE_HALTON)
+    hacc.resize(spec->primeinx.size());
+  else
+    acc.resize(spec->num.size());
+  packAcc();
+}
+
+void SequenceSpec::chooseLimbs()
+/* Picks the narrowest fixed width that holds every denominator and copies
+ * num and denom into limbs. Call after changing num or denom.
+ */
+{
+  int i;
+  size_t bits=0;
+  for (i=0;i<denom.size();i++)
+    if (mpz_sizeinbase(denom[i].get_mpz_t(),2)>bits)
+      bits=mpz_sizeinbase(denom[i].get_mpz_t(),2);
+  if (mode!=QL_MODE_RICHTMYER || bits>256)
+    limbs=0;
+  else if (bits>128)
+    limbs=4;
+  else if (bits>64)
+    limbs=2;
+  else
+    limbs=1;
+  fnum.resize(limbs*num.size());
+  fdenom.resize(limbs*denom.size());
+  for (i=0;limbs && i<num.size();i++)
+  {
+    mpzToLimbs(&fnum[i*limbs],num[i],limbs);
+    mpzToLimbs(&fdenom[i*limbs],denom[i],limbs);
+  }
+}
+
+void SequenceSpec::fillStride()
+/* Multiplies num by stride, or writes stride in base pp for Halton.
+ * Call after chooseLimbs.
+ */
+{
+  int i,k,pp;
+  snum.clear();
+  fsnum.clear();
+  hstride.clear();
+  hpp.clear();
+  if (mode==QL_MODE_HALTON)
+  {
+    hstride.resize(primeinx.size());
+    for (i=0;i<primeinx.size();i++)
+    {
+      pp=primePower(nthprime(primeinx[i]))[1];
+      hpp.push_back(pp);
+      for (k=stride;k;k/=pp)
+	hstride[i].push_back(k%pp);
+    }
+  }
+  else if (stride>1)
+  {
+    snum.resize(num.size());
+    fsnum.resize(limbs*num.size());
+    for (i=0;i<num.size();i++)
+    {
+      snum[i]=(num[i]*stride)%denom[i];
+      if (limbs)
+	mpzToLimbs(&fsnum[i*limbs],snum[i],limbs);
+    }
+  }
+}
+
+void Quadlods::packAcc()
+{
+  int i;
+  facc.resize(spec->limbs*acc.size());
+  for (i=0;spec->limbs && i<acc.size();i++)
+    mpzToLimbs(&facc[i*spec->limbs],acc[i],spec->limbs);
+  hword.resize(hacc.size());
+  hlen.resize(hacc.size());
+  for (i=0;i<hacc.size();i++)
+    packLimbs(hword[i],hlen[i],hacc[i]);
+}
+
+void Quadlods::unpackAcc()
+{
+  int i;
+  for (i=0;spec->limbs && i<acc.size();i++)
+    acc[i]=limbsToMpz(&facc[i*spec->limbs],spec->limbs);
+  for (i=0;i<hacc.size();i++)
+    unpackLimbs(hacc[i],hword[i],hlen[i]);
+}
+
+const vector<unsigned short> &Quadlods::haccLimbs(int i)
+// Unpacks only the ith Halton accumulator, for the slow readouts.
+{
+  unpackLimbs(hacc[i],hword[i],hlen[i]);
+  return hacc[i];
+}
+
+mpz_class Quadlods::getacc(int n)
+{
+  if (spec->limbs)
+    return limbsToMpz(&facc[n*spec->limbs],spec->limbs);
+  else
+    return acc[n];
+}
+
+void Quadlods::init(int dimensions,double resolution,int j)
+/* Sets num[i]/denom[i] to a rational approximation of an integer in Q(sqrt(primes[i])).
+ * If p mod 4 is 1, q=(sqrt(p)+1)/2, else q=sqrt(p).
+ * 2: p²-2=0
+ * 3: p²-3=0
+ * 5: p²-p-1=0 p-1=1/p
+ * 7: p²-7=0
+ * 11: p²-11=0
+ * 13: p²-p-3=0 p-1=3/p
+ * 17: p²-p-4=0 p-1=4/p
+ * Then sets num=num%denom.
+ * (99/70)²-99/70=99²/70²-99*70/70²
+ *
+ * If this has already been initialized, and the mode is not changed,
+ * the previous primes remain. To clear them, initialize with dimensions=0.
+ *
+ * A generator that has no dimensions before this call, as after
+ * initializing with dimensions=0, shares its spec with others initialized
+ * the same way, and its spec is kept in the cache directory, if one is set.
+ */
+{
+  int i,n,newmode;
+  shared_ptr<SequenceSpec> s=make_shared<SequenceSpec>(*spec);
+  shared_ptr<const SequenceSpec> cached;
+  call_once(primesOnce,initprimes);
+  unpackAcc();
+  clearHaltonCache();
+  if (dimensions>QL_MAX_DIMS)
+    dimensions=QL_MAX_DIMS;
+  if (dimensions<-QL_MAX_DIMS)
+    dimensions=-QL_MAX_DIMS;
+  newmode=resolution?QL_MODE_RICHTMYER:QL_MODE_HALTON;
+  if (s->mode!=newmode)
+    s->primeinx.clear();
+  n=s->primeinx.size();
+  for (i=n;i<dimensions;i++)
+    s->primeinx.push_back(i);
+  for (i=-n;i>dimensions;i--)
+    s->primeinx.push_back(QL_MAX_DIMS+i-1);
+  if (j==QL_SCRAMBLE_DEFAULT)
+    if (newmode==QL_MODE_HALTON)
+      j=QL_SCRAMBLE_TIPWITCH;
+    else
+      j=QL_SCRAMBLE_GRAY;
+  if (j>=0)
+    s->scrambletype=j;
+  if (s->scrambletype<0 || s->scrambletype>QL_SCRAMBLE_TIPWITCH)
+    s->scrambletype=QL_SCRAMBLE_TIPWITCH;
+  s->mode=newmode;
+  s->primeinx.resize(abs(dimensions));
+  if (!n)
+    cached=cachedSpec(*s,resolution);
+  if (cached)
+    spec=cached;
+  else
+  {
+    if (n || !loadSpec(*s,resolution))
+    {
+      if (newmode==QL_MODE_HALTON)
+      {
+	s->num.clear();
+	s->denom.clear();
+      }
+      else
+	s->fillQuads(n,resolution);
+      s->fillTables();
+      if (!n)
+	saveSpec(*s,resolution);
+    }
+    s->chooseLimbs();
+    s->fillStride();
+    if (!n)
+      cacheSpec(s,resolution);
+    spec=s;
+  }
+  setSize();
+}
+
+void Quadlods::init(vector<int> dprimes,double resolution,int j)
+/* Used for testing, setting up a generator with a particularly
+ * bad set of primes.
+ */
+{
+  int i,k,n,newmode;
+  vector<bool> used(QL_MAX_DIMS,false);
+  shared_ptr<SequenceSpec> s=make_shared<SequenceSpec>(*spec);
+  call_once(primesOnce,initprimes);
+  unpackAcc();
+  clearHaltonCache();
+  newmode=resolution?QL_MODE_RICHTMYER:QL_MODE_HALTON;
+  if (s->mode!=newmode)
+    s->primeinx.clear();
+  n=s->primeinx.size();
+  for (i=0;i<n;i++)
+    used[s->primeinx[i]]=true;
+  for (i=0;i<dprimes.size();i++)
+  {
+    k=primeIndex(dprimes[i]);
+    if (k>=0 && !used[k])
+    {
+      s->primeinx.push_back(k);
+      used[k]=true;
+    }
+  }
+  if (j==QL_SCRAMBLE_DEFAULT)
+    if (newmode==QL_MODE_HALTON)
+      j=QL_SCRAMBLE_TIPWITCH;
+    else
+      j=QL_SCRAMBLE_GRAY;
+  if (j>=0)
+    s->scrambletype=j;
+  if (s->scrambletype<0 || s->scrambletype>QL_SCRAMBLE_TIPWITCH)
+    s->scrambletype=QL_SCRAMBLE_TIPWITCH;
+  s->mode=newmode;
+  if (s->primeinx.size()>dprimes.size())
+    s->primeinx.resize(dprimes.size());
+  if (n || !loadSpec(*s,resolution))
+  {
+    if (newmode==QL_MODE_HALTON)
+    {
+      s->num.clear();
+      s->denom.clear();
+    }
+    else
+      s->fillQuads(n,resolution);
+    s->fillTables();
+    if (!n)
+      saveSpec(*s,resolution);
+  }
+  s->chooseLimbs();
+  s->fillStride();
+  spec=s;
+  setSize();
+}
+
+void Quadlods::setSize()
+/* Makes the accumulators match the spec after init. A new Halton
+ * accumulator is set to the same number as the others.
+ */
+{
+  int i,n=hacc.size();
+  if (spec->mode==QL_MODE_HALTON)
+  {
+    acc.clear();
+    hacc.resize(spec->primeinx.size());
+    for (i=n;i<hacc.size();i++)
+      if (i)
+	incHacc(hacc[i],primePower(nthprime(spec->primeinx[i]))[1],
+		haccValue(hacc[i-1],primePower(nthprime(spec->primeinx[i-1]))[1],sign),false);
+  }
+  else
+  {
+    hacc.clear();
+    acc.resize(spec->primeinx.size());
+  }
+  packAcc();
+}
+
+mpz_class Quadlods::gethacc(int n)
+// All Halton accumulators should have the same value, so n shouldn't matter.
+{
+  mpz_class ret=sign?-1:0;
+  int i,limbbase;
+  unpackAcc();
+  if (hacc.size())
+  {
+    n%=hacc.size();
+    if (n<0)
+      n+=hacc.size();
+    limbbase=primePower(nthprime(spec->primeinx[n]))[1];
+    for (i=hacc[n].size()-1;i>=0;i--)
+      ret=ret*limbbase*hacc[n][i];
+  }
+  return ret;
+}
+
+void Quadlods::readout1(int i,int scram,mpq_class &ret)
+/* Sets ret to the ith coordinate, scrambled with scram, reusing ret's memory.
+ * The result is canonical.
+ */
+{
+  uint64_t s[4];
+  if (spec->mode==QL_MODE_HALTON)
+  {
+    haccLimbs(i);
+    if (scram==spec->scrambletype)
+      ret=haccReadout(hacc[i],primePower(nthprime(spec->primeinx[i]))[1],spec->hrev[i],sign);
+    else
+      ret=haccReverseScramble(hacc[i],nthprime(spec->primeinx[i]),scram,sign);
+  }
+  else if (spec->limbs)
+  {
+    switch (spec->limbs)
+    {
+      case 1:
+	scrambleLimbs<1>(s,&facc[i],&spec->fdenom[i],scram);
+	break;
+      case 2:
+	scrambleLimbs<2>(s,&facc[2*i],&spec->fdenom[2*i],scram);
+	break;
+      case 4:
+	scrambleLimbs<4>(s,&facc[4*i],&spec->fdenom[4*i],scram);
+	break;
+    }
+    mpz_import(ret.get_num_mpz_t(),spec->limbs,-1,8,0,0,s);
+    mpz_import(ret.get_den_mpz_t(),spec->limbs,-1,8,0,0,&spec->fdenom[i*spec->limbs]);
+    ret.get_num()=(ret.get_num()<<1)|1;
+    ret.get_den()<<=1;
+  }
+  else
+  {
+    bigNumerator(ret.get_num_mpz_t(),i,scram);
+    mpz_mul_2exp(ret.get_den_mpz_t(),spec->denom[i].get_mpz_t(),1);
+  }
+  ret.canonicalize();
+}
+
+void Quadlods::bigNumerator(mpz_t ret,int i,int scram)
+/* Sets ret to twice the ith accumulator, scrambled, plus 1, the numerator
+ * of the coordinate over twice the denominator. For accumulators too wide
+ * for limbs; the scratch numbers are kept so that memory is not allocated
+ * for every point.
+ */
+{
+  scrambleMpz(ret,acc[i].get_mpz_t(),spec->denom[i].get_mpz_t(),scram,
+	      mscratch[0].get_mpz_t(),mscratch[1].get_mpz_t());
+  mpz_mul_2exp(ret,ret,1);
+  mpz_setbit(ret,0);
+}
+
+double Quadlods::dreadout1(int i,int scram)
+{
+  uint64_t s[4];
+  if (spec->mode==QL_MODE_HALTON && scram==spec->scrambletype)
+    return dreadoutHalton(i);
+  if (spec->mode==QL_MODE_HALTON)
+    return haccDouble(hfrac,hword[i],hlen[i],spec->hpp[i],
+		      reverseScrambleRow(nthprime(spec->primeinx[i]),scram),sign);
+  switch (spec->limbs)
+  {
+    case 1:
+      scrambleLimbs<1>(s,&facc[i],&spec->fdenom[i],scram);
+      return limbsReadout<1>(s,&spec->fdenom[i]);
+    case 2:
+      scrambleLimbs<2>(s,&facc[2*i],&spec->fdenom[2*i],scram);
+      return limbsReadout<2>(s,&spec->fdenom[2*i]);
+    case 4:
+      scrambleLimbs<4>(s,&facc[4*i],&spec->fdenom[4*i],scram);
+      return limbsReadout<4>(s,&spec->fdenom[4*i]);
+    default:
+      bigNumerator(mpq_numref(qscratch.get_mpq_t()),i,scram);
+      mpz_mul_2exp(mpq_denref(qscratch.get_mpq_t()),spec->denom[i].get_mpz_t(),1);
+      return qscratch.get_d();
+  }
+}
+
+uint64_t Quadlods::scaleReadout1(int i,uint64_t m)
+/* Returns the ith coordinate times m, rounded down, where m=0 means 2**64.
+ * Richtmyer accumulators too wide for limbs use mpz_class, but no mpq_class.
+ */
+{
+  uint64_t s[4];
+  if (spec->mode==QL_MODE_HALTON)
+    return haccScale(haccLimbs(i),primePower(nthprime(spec->primeinx[i]))[1],spec->hrev[i],sign,m);
+  switch (spec->limbs)
+  {
+    case 1:
+      scrambleLimbs<1>(s,&facc[i],&spec->fdenom[i],spec->scrambletype);
+      return limbsScale<1>(s,&spec->fdenom[i],m);
+    case 2:
+      scrambleLimbs<2>(s,&facc[2*i],&spec->fdenom[2*i],spec->scrambletype);
+      return limbsScale<2>(s,&spec->fdenom[2*i],m);
+    case 4:
+      scrambleLimbs<4>(s,&facc[4*i],&spec->fdenom[4*i],spec->scrambletype);
+      return limbsScale<4>(s,&spec->fdenom[4*i],m);
+    default:
+      bigNumerator(mscratch[2].get_mpz_t(),i,spec->scrambletype);
+      if (m)
+      {
+	mpz_import(mscratch[0].get_mpz_t(),1,-1,8,0,0,&m);
+	mpz_mul(mscratch[2].get_mpz_t(),mscratch[2].get_mpz_t(),mscratch[0].get_mpz_t());
+      }
+      else
+	mpz_mul_2exp(mscratch[2].get_mpz_t(),mscratch[2].get_mpz_t(),64);
+      mpz_mul_2exp(mscratch[0].get_mpz_t(),spec->denom[i].get_mpz_t(),1);
+      mpz_tdiv_q(mscratch[2].get_mpz_t(),mscratch[2].get_mpz_t(),mscratch[0].get_mpz_t());
+      s[0]=0;
+      mpz_export(s,nullptr,-1,8,0,0,mscratch[2].get_mpz_t());
+      return s[0];
+  }
+}
+
+void Quadlods::scaleReadoutBlock(uint64_t *out,uint64_t m)
+// Like dreadoutBlock, but for scaleReadout1.
+{
+  int i,sz=size();
+  if (spec->limbs==1)
+  {
+    fscratch.resize(sz);
+    scrambleBlock(&fscratch[0],&facc[0],&spec->fdenom[0],sz,spec->scrambletype);
+    for (i=0;i<sz;i++)
+      out[i]=limbsScale<1>(&fscratch[i],&spec->fdenom[i],m);
+  }
+  else
+    for (i=0;i<sz;i++)
+      out[i]=scaleReadout1(i,m);
+}
+
+vector<uint32_t> Quadlods::readout32()
+{
+  int i;
+  vector<uint64_t> scaled(size());
+  vector<uint32_t> ret(size());
+  scaleReadoutBlock(scaled.data(),(uint64_t)1<<32);
+  for (i=0;i<ret.size();i++)
+    ret[i]=scaled[i];
+  return ret;
+}
+
+vector<uint64_t> Quadlods::readout64()
+{
+  vector<uint64_t> ret(size());
+  scaleReadoutBlock(ret.data(),0);
+  return ret;
+}
+
+vector<uint64_t> Quadlods::readoutMod(uint64_t m)
+{
+  vector<uint64_t> ret(size());
+  if (m)
+    scaleReadoutBlock(ret.data(),m);
+  return ret;
+}
+
+void Quadlods::readoutPair(vector<mpz_class> &num,vector<mpz_class> &denom)
+/* Sets num[i]/denom[i] to the ith coordinate, without canonicalizing it,
+ * reusing the memory of num and denom. A Richtmyer denominator is twice
+ * denom[i]; a Halton denominator is a power of the prime.
+ */
+{
+  int i,k,pp;
+  uint64_t s[4];
+  num.resize(size());
+  denom.resize(size());
+  for (i=0;i<size();i++)
+    if (spec->mode==QL_MODE_HALTON)
+    {
+      pp=primePower(nthprime(spec->primeinx[i]))[1];
+      num[i]=0;
+      denom[i]=1;
+      for (k=0;k<hlen[i];k++)
+      {
+	num[i]=num[i]*pp+spec->hrev[i][hlimb(i,k)];
+	denom[i]*=pp;
+      }
+      num[i]+=sign;
+    }
+    else if (spec->limbs)
+    {
+      switch (spec->limbs)
+      {
+	case 1:
+	  scrambleLimbs<1>(s,&facc[i],&spec->fdenom[i],spec->scrambletype);
+	  break;
+	case 2:
+	  scrambleLimbs<2>(s,&facc[2*i],&spec->fdenom[2*i],spec->scrambletype);
+	  break;
+	case 4:
+	  scrambleLimbs<4>(s,&facc[4*i],&spec->fdenom[4*i],spec->scrambletype);
+	  break;
+      }
+      mpz_import(num[i].get_mpz_t(),spec->limbs,-1,8,0,0,s);
+      mpz_import(denom[i].get_mpz_t(),spec->limbs,-1,8,0,0,&spec->fdenom[i*spec->limbs]);
+      num[i]=(num[i]<<1)|1;
+      denom[i]<<=1;
+    }
+    else
+    {
+      bigNumerator(num[i].get_mpz_t(),i,spec->scrambletype);
+      mpz_mul_2exp(denom[i].get_mpz_t(),spec->denom[i].get_mpz_t(),1);
+    }
+}
+
+vector<mpq_class> Quadlods::readout()
+{
+  int i;
+  vector<mpq_class> ret(size());
+  for (i=0;i<ret.size();i++)
+    readout1(i,spec->scrambletype,ret[i]);
+  return ret;
+}
+
+vector<double> Quadlods::dreadout()
+{
+  vector<double> ret(size());
+  dreadoutBlock(&ret[0],1);
+  return ret;
+}
+
+void Quadlods::dreadoutBlock(double *out,size_t stride)
+/* Writes the current tuple to out, out+stride, out+2*stride, etc.
+ * One-limb accumulators are scrambled all at once by the vector kernel.
+ */
+{
+  int i,sz=size();
+  if (spec->limbs==1)
+  {
+    fscratch.resize(sz);
+    scrambleBlock(&fscratch[0],&facc[0],&spec->fdenom[0],sz,spec->scrambletype);
+    for (i=0;i<sz;i++)
+      out[i*stride]=limbsReadout<1>(&fscratch[i],&spec->fdenom[i]);
+  }
+  else if (spec->mode==QL_MODE_HALTON)
+    for (i=0;i<sz;i++)
+      out[i*stride]=dreadoutHalton(i);
+  else
+    for (i=0;i<sz;i++)
+      out[i*stride]=dreadout1(i,spec->scrambletype);
+}
+
+void SequenceSpec::fillQuads(int start,double resolution)
+/* Sets num[i]/denom[i] to the approximation of the quadratic irrational
+ * for primeinx[i], for i from start to the end of primeinx. If there are
+ * many, the work is split among up to getThreads() threads.
+ */
+{
+  int i,n=(int)primeinx.size()-start,nthreads=getThreads();
+  vector<thread> threads;
+  auto work=[this,start,resolution](int first,int stride)
+  {
+    int i;
+    for (i=start+first;i<primeinx.size();i+=stride)
+      if (primesCfSorted.size())
+	compquad(primesCfSorted[primeinx[i]].cf,resolution,num[i],denom[i]);
+      else
+	compquad(nthprime(primeinx[i]),resolution,num[i],denom[i]);
+  };
+  num.resize(primeinx.size());
+  denom.resize(primeinx.size());
+  if (nthreads>n/64)
+    nthreads=n/64;
+  for (i=1;i<nthreads;i++)
+    threads.push_back(thread(work,i,nthreads));
+  work(0,nthreads>1?nthreads:1);
+  for (i=0;i<threads.size();i++)
+    threads[i].join();
+}
+
+void SequenceSpec::fillTables()
+/* Fills the reverse scramble tables this sequence needs and sets hrev
+ * to point at them, so that readout doesn't have to look them up.
+ */
+{
+  int i;
+  hrev.resize(mode==QL_MODE_HALTON?primeinx.size():0);
+  for (i=0;i<hrev.size();i++)
+    hrev[i]=reverseScrambleRow(nthprime(primeinx[i]),scrambletype);
+  cacheMap.reset();
+}
+
+void quadlods::setCacheDir(const string &dir)
+{
+  cacheDir=dir;
+}
+
+uint64_t quadlods::checksumWords(const unsigned char *data,size_t n,uint64_t sum)
+/* FNV-1a, a 64-bit word at a time instead of a byte at a time, so that
+ * checking a big Halton file takes little time. n is a multiple of 8.
+ */
+{
+  size_t i;
+  uint64_t word;
+  for (i=0;i<n;i+=8)
+  {
+    memcpy(&word,data+i,8);
+    sum=(sum^word)*0x100000001b3;
+    sum^=sum>>29;
+  }
+  return sum;
+}
+
+void quadlods::appendCache(string &buf,const void *src,size_t n)
 {
-  int i,max=0;
-  for (i=0;i<period && i<terms.size();i++)
-    if (max<terms[terms.size()-i-1])
-      max=terms[terms.size()-i-1];
-  return max;
+  buf.append((const char *)src,n);
 }
 
-bool operator<(const PrimeContinuedFraction &a,const PrimeContinuedFraction &b)
+void quadlods::padCache(string &buf)
+// Pads buf with zeros to a multiple of 8 bytes.
 {
-  double aavg=a.cf.averageTerm(),bavg=b.cf.averageTerm();
-  int amax=a.cf.maximumTerm(),bmax=b.cf.maximumTerm();
-  if (amax!=bmax)
-    return amax<bmax;
-  else if (fabs(aavg-bavg)>1e-10)
-    return aavg<bavg;
-  else
-    return a.prime<b.prime;
+  buf.resize((buf.size()+7)&~(size_t)7);
 }
 
-Quadlods::Quadlods()
+bool quadlods::readCache(const unsigned char *&ptr,const unsigned char *end,void *dest,size_t n)
 {
-  mode=QL_MODE_RICHTMYER;
-  scrambletype=QL_SCRAMBLE_NONE;
-  sign=false;
+  if (end-ptr<n)
+    return false;
+  memcpy(dest,ptr,n);
+  ptr+=n;
+  return true;
 }
 
-void Quadlods::init(int dimensions,double resolution,int j)
-/* Sets num[i]/denom[i] to a rational approximation of an integer in Q(sqrt(primes[i])).
- * If p mod 4 is 1, q=(sqrt(p)+1)/2, else q=sqrt(p).
- * 2: p²-2=0
- * 3: p²-3=0
- * 5: p²-p-1=0 p-1=1/p
- * 7: p²-7=0
- * 11: p²-11=0
- * 13: p²-p-3=0 p-1=3/p
- * 17: p²-p-4=0 p-1=4/p
- * Then sets num=num%denom.
- * (99/70)²-99/70=99²/70²-99*70/70²
- *
- * If this has already been initialized, and the mode is not changed,
- * the previous primes remain. To clear them, initialize with dimensions=0.
+string quadlods::cacheHead(const SequenceSpec &s,double resolution)
+/* The head of a cache file, which is what the file is looked up by:
+ * mode, scramble type, and number of dimensions as 32-bit integers,
+ * a zero, the resolution, and the primes as 16-bit integers.
  */
 {
-  int i,p,newmode;
-  mpz_class nmid,dmid;
-  if (dimensions>QL_MAX_DIMS)
-    dimensions=QL_MAX_DIMS;
-  if (dimensions<-QL_MAX_DIMS)
-    dimensions=-QL_MAX_DIMS;
-  newmode=resolution?QL_MODE_RICHTMYER:QL_MODE_HALTON;
-  if (mode!=newmode)
-    primeinx.clear();
-  if (newmode==QL_MODE_HALTON)
+  int i;
+  string ret;
+  uint32_t word[4]={(uint32_t)s.mode,(uint32_t)s.scrambletype,(uint32_t)s.primeinx.size(),0};
+  unsigned short p;
+  appendCache(ret,word,sizeof(word));
+  appendCache(ret,&resolution,sizeof(resolution));
+  for (i=0;i<s.primeinx.size();i++)
   {
-    num.clear();
-    denom.clear();
-    acc.clear();
-    for (i=hacc.size();i<dimensions;i++)
-    {
-      primeinx.push_back(i);
-      p=nthprime(i);
-      hacc.resize(primeinx.size());
-      if (i)
-	incHacc(hacc[i],primePower(p)[1],
-		haccValue(hacc[i-1],primePower(nthprime(primeinx[i-1]))[1],sign),false);
-    }
-    for (i=-hacc.size();i>dimensions;i--)
-    {
-      primeinx.push_back(QL_MAX_DIMS+i-1);
-      p=nthprime(QL_MAX_DIMS+i-1);
-      hacc.resize(primeinx.size());
-      if (i)
-	incHacc(hacc[-i],primePower(p)[1],
-		haccValue(hacc[-1-i],primePower(nthprime(primeinx[-1-i]))[1],sign),false);
-    }
+    p=nthprime(s.primeinx[i]);
+    appendCache(ret,&p,sizeof(p));
   }
-  else
+  padCache(ret);
+  return ret;
+}
+
+string quadlods::cacheName(const string &head)
+{
+  char hex[17];
+  snprintf(hex,sizeof(hex),"%016llx",(unsigned long long)
+	   checksumWords((const unsigned char *)head.data(),head.size(),checksumStart));
+  return cacheDir+"/quadlods-"+hex+".cache";
+}
+
+void quadlods::writeCacheChunk(ofstream &file,string &buf,uint64_t *header)
+/* Pads buf, adds it to the checksum and length in header, writes it,
+ * and empties it.
+ */
+{
+  padCache(buf);
+  header[1]=checksumWords((const unsigned char *)buf.data(),buf.size(),header[1]);
+  header[2]+=buf.size();
+  file.write(buf.data(),buf.size());
+  buf.clear();
+}
+
+bool quadlods::loadSpec(SequenceSpec &s,double resolution)
+/* Fills in s from the cache, if there is a file whose head matches s
+ * and whose checksum is right. After the head, a Richtmyer file has,
+ * for each dimension, the byte lengths of num and denom as 32-bit
+ * integers and their bytes, least significant first; a Halton file has,
+ * for each dimension, the length of the reverse scramble table as a
+ * 64-bit integer and the table, 0 meaning the row isn't a table.
+ * Everything is in native byte order and each part is padded to 8 bytes.
+ */
+{
+  int i,n=s.primeinx.size();
+  string head;
+  shared_ptr<MappedFile> file;
+  const unsigned char *ptr,*start,*end;
+  uint64_t header[3],tableLen;
+  uint32_t len[2];
+  bool ok=true;
+  if (cacheDir.empty())
+    return false;
+  head=cacheHead(s,resolution);
+  file=make_shared<MappedFile>();
+  file->open(cacheName(head));
+  if (file->size<sizeof(header)+head.size())
+    return false;
+  memcpy(header,file->data,sizeof(header));
+  start=ptr=file->data+sizeof(header);
+  end=file->data+file->size;
+  if (header[0]!=cacheMagic || header[2]!=end-start || header[2]%8 ||
+      memcmp(start,head.data(),head.size()) ||
+      checksumWords(start,header[2],checksumStart)!=header[1])
+    return false;
+  ptr+=head.size();
+  if (s.mode==QL_MODE_HALTON)
   {
-    hacc.clear();
-    for (i=denom.size();i<dimensions;i++)
+    s.num.clear();
+    s.denom.clear();
+    s.hrev.resize(n);
+    for (i=0;ok && i<n;i++)
     {
-      primeinx.push_back(i);
-      if (primesCfSorted.size())
-	compquad(primesCfSorted[i].cf,resolution,nmid,dmid);
-      else
+      ok=readCache(ptr,end,&tableLen,sizeof(tableLen)) &&
+	end-ptr>=((2*tableLen+7)&~(uint64_t)7);
+      if (ok && tableLen)
       {
-	p=nthprime(i);
-	compquad(p,resolution,nmid,dmid);
+	ok=tableLen==primePower(nthprime(s.primeinx[i]))[1];
+	s.hrev[i]=ScrambleRow();
+	s.hrev[i].table=(const unsigned short *)ptr;
+	ptr+=(2*tableLen+7)&~(uint64_t)7;
       }
-      denom.push_back(dmid);
-      num.push_back(nmid);
+      else if (ok)
+	s.hrev[i]=reverseScrambleRow(nthprime(s.primeinx[i]),s.scrambletype);
     }
-    for (i=-denom.size();i>dimensions;i--)
+  }
+  else
+  {
+    s.num.resize(n);
+    s.denom.resize(n);
+    s.hrev.clear();
+    for (i=0;ok && i<n;i++)
     {
-      primeinx.push_back(QL_MAX_DIMS+i-1);
-      if (primesCfSorted.size())
-	compquad(primesCfSorted[QL_MAX_DIMS+i-1].cf,resolution,nmid,dmid);
-      else
+      ok=readCache(ptr,end,len,sizeof(len)) && end-ptr>=(uint64_t)len[0]+len[1];
+      if (ok)
       {
-	p=nthprime(QL_MAX_DIMS+i-1);
-	compquad(p,resolution,nmid,dmid);
+	mpz_import(s.num[i].get_mpz_t(),len[0],-1,1,0,0,ptr);
+	mpz_import(s.denom[i].get_mpz_t(),len[1],-1,1,0,0,ptr+len[0]);
+	ptr+=len[0]+len[1];
+	ptr=start+((ptr-start+7)&~(ptrdiff_t)7);
       }
-      denom.push_back(dmid);
-      num.push_back(nmid);
     }
   }
-  if (j==QL_SCRAMBLE_DEFAULT)
-    if (newmode==QL_MODE_HALTON)
-      j=QL_SCRAMBLE_TIPWITCH;
-    else
-      j=QL_SCRAMBLE_GRAY;
-  if (j>=0)
-    scrambletype=j;
-  if (scrambletype<0 || scrambletype>QL_SCRAMBLE_TIPWITCH)
-    scrambletype=QL_SCRAMBLE_TIPWITCH;
-  mode=newmode;
-  dimensions=abs(dimensions);
-  primeinx.resize(dimensions);
-  if (mode==QL_MODE_RICHTMYER)
-  {
-    num.resize(dimensions);
-    denom.resize(dimensions);
-    acc.resize(dimensions);
-  }
+  if (ok && ptr==end)
+    s.cacheMap=file;
+  return ok && ptr==end;
 }
 
-void Quadlods::init(vector<int> dprimes,double resolution,int j)
-/* Used for testing, setting up a generator with a particularly
- * bad set of primes.
+void quadlods::saveSpec(const SequenceSpec &s,double resolution)
+/* Writes s to the cache in the format loadSpec reads. The file is written
+ * under a temporary name and renamed, so that another process never sees
+ * it half-written. If writing fails, nothing is cached.
  */
 {
-  int i,k,p,newmode;
-  mpz_class nmid,dmid;
-  newmode=resolution?QL_MODE_RICHTMYER:QL_MODE_HALTON;
-  if (mode!=newmode)
-    primeinx.clear();
-  for (i=0;i<dprimes.size();i++)
-  {
-    for (k=0;k<primeinx.size();k++)
-      if (dprimes[i]==nthprime(primeinx[k]))
-	dprimes[i]=0;
-    for (k=0;k<QL_MAX_DIMS;k++)
-      if (dprimes[i]==nthprime(k))
-      {
-        primeinx.push_back(k);
-        k=8191;
-      }
-  }
-  for (i=newmode?hacc.size():denom.size();i<primeinx.size();i++)
+  int i;
+  string head,name,tmpName,buf;
+  ofstream file;
+  uint64_t header[3]={cacheMagic,checksumStart,0},tableLen;
+  uint32_t len[2];
+  size_t pos;
+  bool ok;
+  if (cacheDir.empty())
+    return;
+  head=cacheHead(s,resolution);
+  name=cacheName(head);
+#ifdef _WIN32
+  tmpName=name+'.'+to_string(GetCurrentProcessId());
+#else
+  tmpName=name+'.'+to_string(getpid());
+#endif
+  tmpName+='.'+to_string(hash<thread::id>()(this_thread::get_id()))+".tmp";
+  file.open(tmpName,ios::binary|ios::trunc);
+  file.write((const char *)header,sizeof(header));
+  buf=head;
+  writeCacheChunk(file,buf,header);
+  for (i=0;i<s.primeinx.size();i++)
   {
-    if (newmode==QL_MODE_RICHTMYER)
+    if (s.mode==QL_MODE_HALTON)
     {
-      if (primesCfSorted.size())
-	compquad(primesCfSorted[primeinx[i]].cf,resolution,nmid,dmid);
-      else
-      {
-	p=nthprime(primeinx[i]);
-	compquad(p,resolution,nmid,dmid);
-      }
-      denom.push_back(dmid);
-      num.push_back(nmid);
+      tableLen=s.hrev[i].table?primePower(nthprime(s.primeinx[i]))[1]:0;
+      appendCache(buf,&tableLen,sizeof(tableLen));
+      if (tableLen)
+	appendCache(buf,s.hrev[i].table,2*tableLen);
     }
-    if (newmode==QL_MODE_HALTON)
+    else
     {
-      if (primesCfSorted.size())
-	p=primesCfSorted[primeinx[i]].prime;
-      else
-	p=nthprime(primeinx[i]);
-      hacc.push_back(vector<unsigned short>());
+      len[0]=sgn(s.num[i])?(mpz_sizeinbase(s.num[i].get_mpz_t(),2)+7)/8:0;
+      len[1]=sgn(s.denom[i])?(mpz_sizeinbase(s.denom[i].get_mpz_t(),2)+7)/8:0;
+      appendCache(buf,len,sizeof(len));
+      pos=buf.size();
+      buf.resize(pos+len[0]+len[1]);
+      mpz_export(&buf[pos],nullptr,-1,1,0,0,s.num[i].get_mpz_t());
+      mpz_export(&buf[pos+len[0]],nullptr,-1,1,0,0,s.denom[i].get_mpz_t());
     }
+    writeCacheChunk(file,buf,header);
   }
-  if (j==QL_SCRAMBLE_DEFAULT)
-    if (newmode==QL_MODE_HALTON)
-      j=QL_SCRAMBLE_TIPWITCH;
-    else
-      j=QL_SCRAMBLE_GRAY;
-  if (j>=0)
-    scrambletype=j;
-  if (scrambletype<0 || scrambletype>QL_SCRAMBLE_TIPWITCH)
-    scrambletype=QL_SCRAMBLE_TIPWITCH;
-  mode=newmode;
-  if (primeinx.size()>dprimes.size())
-    primeinx.resize(dprimes.size());
-  if (mode==QL_MODE_RICHTMYER)
-  {
-    num.resize(primeinx.size());
-    denom.resize(primeinx.size());
-    acc.resize(primeinx.size());
-  }
+  file.seekp(0);
+  file.write((const char *)header,sizeof(header));
+  ok=file.good();
+  file.close();
+  if (!ok || rename(tmpName.c_str(),name.c_str()))
+    remove(tmpName.c_str());
 }
 
-mpz_class Quadlods::gethacc(int n)
-// All Halton accumulators should have the same value, so n shouldn't matter.
+void Quadlods::clearHaltonCache()
 {
-  mpz_class ret=sign?-1:0;
-  int i,limbbase;
-  if (hacc.size())
-  {
-    n%=hacc.size();
-    if (n<0)
-      n+=hacc.size();
-    limbbase=primePower(nthprime(primeinx[n]))[1];
-    for (i=hacc[n].size()-1;i>=0;i--)
-      ret=ret*limbbase*hacc[n][i];
-  }
-  return ret;
+  hweight.clear();
+  hterm.clear();
+  hsum.clear();
+  hdirty.clear();
 }
 
-vector<mpq_class> Quadlods::readout()
+void Quadlods::syncHalton(int i)
+/* Brings hterm[i] and hsum for dimension i up to date with hword[i].
+ * Only the limbs that step changed, and any new limbs, are recomputed.
+ */
 {
-  int i,p;
-  vector<mpq_class> ret;
-  for (i=0;mode==QL_MODE_RICHTMYER && i<num.size();i++)
+  int k,n,len=hlen[i],pp=spec->hpp[i];
+  unsigned __int128 sum,w,term;
+  vector<uint64_t> &weight=hweight[i],&terms=hterm[i];
+  for (k=weight.size()/2;k<len;k++)
   {
-    ret.push_back(mpq_class((scramble(acc[i],denom[i],scrambletype)<<1)|1,denom[i]<<1));
-    ret[i].canonicalize();
+    if (k)
+      w=(((unsigned __int128)weight[2*k-1]<<64)|weight[2*k-2])/pp;
+    else
+    {
+      w=~(unsigned __int128)0;
+      w=w/pp+(w%pp==pp-1);
+    }
+    weight.push_back((uint64_t)w);
+    weight.push_back((uint64_t)(w>>64));
   }
-  for (i=0;mode==QL_MODE_HALTON && i<hacc.size();i++)
+  n=terms.size()/2;
+  terms.resize(2*len);
+  sum=((unsigned __int128)hsum[2*i+1]<<64)|hsum[2*i];
+  for (k=0;k<len;k++)
   {
-    p=nthprime(primeinx[i]);
-    ret.push_back(haccReverseScramble(hacc[i],p,scrambletype,sign));
-    ret[i].canonicalize();
+    if (k==hdirty[i] && k<n)
+      k=n;
+    if (k==len)
+      break;
+    if (k<n)
+      sum-=((unsigned __int128)terms[2*k+1]<<64)|terms[2*k];
+    w=((unsigned __int128)weight[2*k+1]<<64)|weight[2*k];
+    term=w*spec->hrev[i][hlimb(i,k)];
+    sum+=term;
+    terms[2*k]=(uint64_t)term;
+    terms[2*k+1]=(uint64_t)(term>>64);
   }
-  return ret;
+  hsum[2*i]=(uint64_t)sum;
+  hsum[2*i+1]=(uint64_t)(sum>>64);
+  hdirty[i]=0;
 }
 
-vector<double> Quadlods::dreadout()
+double Quadlods::dreadoutHalton(int i)
+/* Returns the ith coordinate as a double from the cached sum. Each term is
+ * short of the exact digit/pp**(k+1) by less than pp/2**128, so the exact
+ * coordinate is in [sum,sum+(len+1)*pp)/2**128. If both ends truncate to
+ * the same double, that is the answer; otherwise haccDouble computes it
+ * exactly from the limbs.
+ */
 {
-  int i,p;
-  vector<double> ret;
-  for (i=0;mode==QL_MODE_RICHTMYER && i<num.size();i++)
+  int len=hlen[i],pp=spec->hpp[i];
+  unsigned __int128 lo,hi;
+  if (hscram!=spec->scrambletype || hsum.size()!=2*size())
   {
-    ret.push_back(mpq_class((scramble(acc[i],denom[i],scrambletype)<<1)|1,denom[i]<<1).get_d());
+    hscram=spec->scrambletype;
+    hweight.resize(size());
+    hterm.assign(size(),vector<uint64_t>());
+    hsum.assign(2*size(),0);
+    hdirty.assign(size(),0);
   }
-  for (i=0;mode==QL_MODE_HALTON && i<hacc.size();i++)
+  syncHalton(i);
+  if (len)
   {
-    p=nthprime(primeinx[i]);
-    ret.push_back(haccReverseScramble(hacc[i],p,scrambletype,sign).get_d());
+    lo=((unsigned __int128)hsum[2*i+1]<<64)|hsum[2*i];
+    if (sign)
+      lo+=((unsigned __int128)hweight[i][2*len-1]<<64)|hweight[i][2*len-2];
+    hi=lo+(unsigned __int128)(len+1)*pp;
+    if (hi>lo && truncate53(lo)==truncate53(hi))
+      return fixedToDouble(lo);
   }
-  return ret;
+  return haccDouble(hfrac,hword[i],len,pp,spec->hrev[i],sign);
 }
 
 vector<mpq_class> Quadlods::readoutUnscrambled()
 {
-  int i,p;
-  vector<mpq_class> ret;
-  for (i=0;mode==QL_MODE_RICHTMYER && i<num.size();i++)
-  {
-    ret.push_back(mpq_class((acc[i]<<1)|1,denom[i]<<1));
-    ret[i].canonicalize();
-  }
-  for (i=0;mode==QL_MODE_HALTON && i<hacc.size();i++)
-  {
-    p=nthprime(primeinx[i]);
-    ret.push_back(haccReverseScramble(hacc[i],p,QL_SCRAMBLE_NONE,sign));
-    ret[i].canonicalize();
-  }
+  int i;
+  vector<mpq_class> ret(size());
+  for (i=0;i<ret.size();i++)
+    readout1(i,QL_SCRAMBLE_NONE,ret[i]);
   return ret;
 }
 
 vector<double> Quadlods::dreadoutUnscrambled()
 {
-  int i,p;
-  vector<double> ret;
-  for (i=0;mode==QL_MODE_RICHTMYER && i<num.size();i++)
-  {
-    ret.push_back(mpq_class((acc[i]<<1)|1,denom[i]<<1).get_d());
-  }
-  for (i=0;mode==QL_MODE_HALTON && i<hacc.size();i++)
-  {
-    p=nthprime(primeinx[i]);
-    ret.push_back(haccReverseScramble(hacc[i],p,QL_SCRAMBLE_NONE,sign).get_d());
-  }
+  int i;
+  vector<double> ret(size());
+  for (i=0;i<ret.size();i++)
+    ret[i]=dreadout1(i,QL_SCRAMBLE_NONE);
   return ret;
 }
 
@@ -912,54 +2760,142 @@ void Quadlods::setmiddle()
  */
 {
   int i;
-  for (i=0;i<num.size();i++)
-    acc[i]=denom[i]>>1;
+  for (i=0;i<spec->num.size();i++)
+    acc[i]=spec->denom[i]>>1;
+  packAcc();
 }
 
 void Quadlods::setscramble(int j)
 {
+  shared_ptr<SequenceSpec> s;
   if (j==QL_SCRAMBLE_DEFAULT)
-    if (mode==QL_MODE_HALTON)
+    if (spec->mode==QL_MODE_HALTON)
       j=QL_SCRAMBLE_TIPWITCH;
     else
       j=QL_SCRAMBLE_GRAY;
-  scrambletype=j;
+  if (j!=spec->scrambletype)
+  {
+    s=make_shared<SequenceSpec>(*spec);
+    s->scrambletype=j;
+    s->fillTables();
+    spec=s;
+  }
+}
+
+void Quadlods::setStride(int stride,int offset)
+{
+  shared_ptr<SequenceSpec> s;
+  if (stride<1)
+    stride=1;
+  if (stride!=spec->stride)
+  {
+    s=make_shared<SequenceSpec>(*spec);
+    s->stride=stride;
+    s->fillStride();
+    spec=s;
+  }
+  advance(offset+1-stride);
 }
 
 void Quadlods::advance(mpz_class n)
 {
   int i,pp;
   bool newsign=sign;
-  for (i=0;i<num.size();i++)
-    if (n<0)
-      acc[i]=(acc[i]-n*(denom[i]-num[i]))%denom[i];
-    else
-      acc[i]=(acc[i]+n*num[i])%denom[i];
+  unpackAcc();
+  clearHaltonCache();
+  for (i=0;i<spec->num.size();i++)
+  {
+    mpz_addmul(acc[i].get_mpz_t(),n.get_mpz_t(),spec->num[i].get_mpz_t());
+    mpz_fdiv_r(acc[i].get_mpz_t(),acc[i].get_mpz_t(),spec->denom[i].get_mpz_t());
+  }
   for (i=0;i<hacc.size();i++)
   {
-    pp=primePower(nthprime(primeinx[i]))[1];
+    pp=primePower(nthprime(spec->primeinx[i]))[1];
     newsign=incHacc(hacc[i],pp,n,sign);
   }
   sign=newsign;
+  packAcc();
+}
+
+void Quadlods::step()
+/* Same as advance(spec->stride), but without making an mpz_class.
+ * A Halton accumulator is incremented a limb of the stride at a time,
+ * adding straight into the packed word unless the limb carries or is new.
+ */
+{
+  int i,j,k,m,d,pp;
+  uint64_t *word;
+  bool newsign=sign;
+  const vector<mpz_class> &num=(spec->stride>1)?spec->snum:spec->num;
+  const uint64_t *fnum=(spec->stride>1)?spec->fsnum.data():spec->fnum.data();
+  const vector<unsigned short> *digits;
+  switch (spec->limbs)
+  {
+    case 1:
+      addmodBlock(&facc[0],fnum,&spec->fdenom[0],num.size());
+      break;
+    case 2:
+      for (i=0;i<num.size();i++)
+	addmodLimbs<2>(&facc[2*i],&fnum[2*i],&spec->fdenom[2*i]);
+      break;
+    case 4:
+      for (i=0;i<num.size();i++)
+	addmodLimbs<4>(&facc[4*i],&fnum[4*i],&spec->fdenom[4*i]);
+      break;
+    default:
+      for (i=0;i<num.size();i++)
+      {
+	acc[i]+=num[i];
+	if (acc[i]>=spec->denom[i])
+	  acc[i]-=spec->denom[i];
+      }
+  }
+  for (i=0;i<hacc.size();i++)
+  {
+    pp=spec->hpp[i];
+    digits=&spec->hstride[i];
+    newsign=sign;
+    for (j=0;j<digits->size();j++)
+      if ((d=(*digits)[j]))
+      {
+	word=hword[i].data();
+	if (j<hlen[i] && hlimb(i,j)+d<pp)
+	  word[j>>2]+=(uint64_t)d<<(16*(j&3));
+	else
+	  newsign=incHword(hword[i],hlen[i],pp,d,j,newsign);
+      }
+    if (i<hdirty.size())
+    { /* Limbs up to the top limb of the stride have changed. If that limb
+       * carried, so have the limbs up to the next nonzero one.
+       */
+      m=digits->size()-1;
+      k=m;
+      if (hlimb(i,m)<(*digits)[m]+(m>0))
+	for (k=m+1;k<hlen[i] && hlimb(i,k)==0;k++);
+      if (k>=hdirty[i])
+	hdirty[i]=k+1;
+    }
+  }
+  sign=newsign;
 }
 
 unsigned int Quadlods::seedsize()
 {
   unsigned i,maxlen,len;
   mpz_class prod=1;
-  for (i=maxlen=0;i<denom.size();i++)
+  for (i=maxlen=0;i<spec->denom.size();i++)
   {
-    len=(mpz_sizeinbase(denom[i].get_mpz_t(),2)+7)/8;
+    len=(mpz_sizeinbase(spec->denom[i].get_mpz_t(),2)+7)/8;
     if (len>maxlen)
       maxlen=len;
   }
   for (i=0;i<hacc.size();i++)
-    prod*=nthprime(primeinx[i]);
-  if (mode==QL_MODE_HALTON)
+    prod*=nthprime(spec->primeinx[i]);
+  if (spec->mode==QL_MODE_HALTON)
     len=(mpz_sizeinbase(prod.get_mpz_t(),2)+7)/8;
   else
     len=0;
-  return maxlen*denom.size()+len;
+  return maxlen*spec->denom.size()+len;
 }
 
 void Quadlods::seed(char *s,unsigned int n)
@@ -975,50 +2911,276 @@ void Quadlods::seed(char *s,unsigned int n)
 {
   unsigned i,sz;
   mpz_class haltonStep;
-  sz=denom.size();
+  unpackAcc();
+  sz=spec->denom.size();
   for (i=0;sz && i<n;i++)
-    acc[i%sz]=((acc[i%sz]<<8)+(s[i]&0xff))%denom[i%sz];
+    acc[i%sz]=((acc[i%sz]<<8)+(s[i]&0xff))%spec->denom[i%sz];
   sz=hacc.size();
   for (i=0;sz && i<n;i++)
     haltonStep=haltonStep*257+((s[i]&128)?(s[i]+1):(s[i]|-128));
+  packAcc();
   advance(haltonStep);
 }
 
 vector<mpq_class> Quadlods::gen()
 {
-  advance(1);
+  step();
   return readout();
 }
 
 vector<double> Quadlods::dgen()
 {
-  advance(1);
+  step();
   return dreadout();
 }
 
+vector<uint32_t> Quadlods::gen32()
+{
+  step();
+  return readout32();
+}
+
+vector<uint64_t> Quadlods::gen64()
+{
+  step();
+  return readout64();
+}
+
+vector<uint64_t> Quadlods::genMod(uint64_t m)
+{
+  step();
+  return readoutMod(m);
+}
+
+void Quadlods::pointAt(const mpz_class &index,vector<mpq_class> &out) const
+/* Richtmyer: adds index*num to a copy of each accumulator, mod denom.
+ * Halton: adds index to a copy of each accumulator.
+ */
+{
+  int i,p,pp;
+  bool newsign;
+  mpz_class a;
+  vector<unsigned short> h;
+  out.resize(size());
+  for (i=0;i<out.size();i++)
+    if (spec->mode==QL_MODE_HALTON)
+    {
+      p=nthprime(spec->primeinx[i]);
+      pp=primePower(p)[1];
+      unpackLimbs(h,hword[i],hlen[i]);
+      newsign=incHacc(h,pp,index,sign);
+      out[i]=haccReadout(h,pp,spec->hrev[i],newsign);
+      out[i].canonicalize();
+    }
+    else
+    {
+      a=spec->limbs?limbsToMpz(&facc[i*spec->limbs],spec->limbs):acc[i];
+      a+=index*spec->num[i];
+      mpz_fdiv_r(a.get_mpz_t(),a.get_mpz_t(),spec->denom[i].get_mpz_t());
+      out[i]=mpq_class((scramble(a,spec->denom[i],spec->scrambletype)<<1)|1,spec->denom[i]<<1);
+      out[i].canonicalize();
+    }
+}
+
+void Quadlods::dpointAt(const mpz_class &index,vector<double> &out) const
+{
+  int i;
+  uint64_t a[4],s[4];
+  mpz_class big;
+  vector<mpq_class> q;
+  if (spec->limbs)
+  {
+    out.resize(size());
+    for (i=0;i<out.size();i++)
+    {
+      big=limbsToMpz(&facc[i*spec->limbs],spec->limbs)+index*spec->num[i];
+      mpz_fdiv_r(big.get_mpz_t(),big.get_mpz_t(),spec->denom[i].get_mpz_t());
+      mpzToLimbs(a,big,spec->limbs);
+      switch (spec->limbs)
+      {
+	case 1:
+	  scrambleLimbs<1>(s,a,&spec->fdenom[i],spec->scrambletype);
+	  out[i]=limbsReadout<1>(s,&spec->fdenom[i]);
+	  break;
+	case 2:
+	  scrambleLimbs<2>(s,a,&spec->fdenom[2*i],spec->scrambletype);
+	  out[i]=limbsReadout<2>(s,&spec->fdenom[2*i]);
+	  break;
+	case 4:
+	  scrambleLimbs<4>(s,a,&spec->fdenom[4*i],spec->scrambletype);
+	  out[i]=limbsReadout<4>(s,&spec->fdenom[4*i]);
+	  break;
+      }
+    }
+  }
+  else
+  {
+    pointAt(index,q);
+    out.resize(q.size());
+    for (i=0;i<q.size();i++)
+      out[i]=q[i].get_d();
+  }
+}
+
+void Quadlods::dgenBatch(size_t n,double *out,int layout,size_t stride)
+/* Generates n tuples into out. With QL_LAYOUT_AOS, tuple i starts at
+ * out+i*stride; with QL_LAYOUT_SOA, dimension j starts at out+j*stride.
+ * stride=0 means packed, i.e. size() for AOS and n for SOA.
+ */
+{
+  size_t i,sz=size();
+  if (stride==0)
+    stride=(layout==QL_LAYOUT_SOA)?n:sz;
+  for (i=0;i<n;i++)
+  {
+    step();
+    if (layout==QL_LAYOUT_SOA)
+      dreadoutBlock(out+i,stride);
+    else
+      dreadoutBlock(out+i*stride,1);
+  }
+}
+
+void Quadlods::dgenParallel(size_t n,double *out,int layout,size_t stride,int nthreads)
+/* Same as dgenBatch, but split among nthreads threads (-1 means
+ * getThreads()), each of which advances a copy of the generator to the
+ * start of its part. This generator does the last part, so that it ends
+ * up where dgenBatch would leave it.
+ */
+{
+  int i;
+  size_t first,count,sz=size();
+  vector<Quadlods> copies;
+  vector<thread> threads;
+  auto work=[out,layout,&stride](Quadlods &gen,size_t first,size_t count)
+  {
+    uint64_t skip=first;
+    gen.advance(limbsToMpz(&skip,1)*gen.spec->stride);
+    gen.dgenBatch(count,out+first*(layout==QL_LAYOUT_SOA?1:stride),layout,stride);
+  };
+  if (stride==0)
+    stride=(layout==QL_LAYOUT_SOA)?n:sz;
+  if (nthreads<0)
+    nthreads=getThreads();
+  if (nthreads>n/1024)
+    nthreads=n/1024;
+  if (nthreads<2)
+    dgenBatch(n,out,layout,stride);
+  else
+  {
+    copies.resize(nthreads-1,*this);
+    for (i=0;i<nthreads-1;i++)
+    {
+      first=n*i/nthreads;
+      count=n*(i+1)/nthreads-first;
+      threads.push_back(thread(work,ref(copies[i]),first,count));
+    }
+    first=n*i/nthreads;
+    work(*this,first,n-first);
+    for (i=0;i<threads.size();i++)
+      threads[i].join();
+  }
+}
+
+void Quadlods::genBatch(size_t n,mpq_class *out,int layout,size_t stride)
+// Same as dgenBatch, but exact. The mpq_class objects are reused.
+{
+  size_t i,j,sz=size();
+  if (stride==0)
+    stride=(layout==QL_LAYOUT_SOA)?n:sz;
+  for (i=0;i<n;i++)
+  {
+    step();
+    for (j=0;j<sz;j++)
+      if (layout==QL_LAYOUT_SOA)
+	readout1(j,spec->scrambletype,out[j*stride+i]);
+      else
+	readout1(j,spec->scrambletype,out[i*stride+j]);
+  }
+}
+
 Quadlods select(Quadlods& b,vector<int> dimensions)
 {
   Quadlods ret;
+  shared_ptr<SequenceSpec> s=make_shared<SequenceSpec>();
   int i,j;
-  ret.scrambletype=b.scrambletype;
-  ret.mode=b.mode;
+  const SequenceSpec &bspec=*b.spec;
+  s->scrambletype=bspec.scrambletype;
+  s->mode=bspec.mode;
   ret.sign=b.sign;
+  b.unpackAcc();
   for (i=0;i<dimensions.size();i++)
     if (dimensions[i]>=0 && dimensions[i]<b.size())
     {
-      for (j=0;j<ret.size() && ret.primeinx[j]!=b.primeinx[dimensions[i]];j++);
-      if (j==ret.size())
+      for (j=0;j<s->primeinx.size() && s->primeinx[j]!=bspec.primeinx[dimensions[i]];j++);
+      if (j==s->primeinx.size())
       {
-	if (b.num.size())
-	  ret.num.     push_back(b.num     [dimensions[i]]);
-	if (b.denom.size())
-	  ret.denom.   push_back(b.denom   [dimensions[i]]);
+	if (bspec.num.size())
+	  s->num.      push_back(bspec.num  [dimensions[i]]);
+	if (bspec.denom.size())
+	  s->denom.    push_back(bspec.denom[dimensions[i]]);
 	if (b.acc.size())
-	  ret.acc.     push_back(b.acc     [dimensions[i]]);
+	  ret.acc.     push_back(b.acc      [dimensions[i]]);
 	if (b.hacc.size())
-	  ret.hacc.    push_back(b.hacc    [dimensions[i]]);
-        ret.primeinx.push_back(b.primeinx[dimensions[i]]);
+	  ret.hacc.    push_back(b.hacc     [dimensions[i]]);
+        s->primeinx.push_back(bspec.primeinx[dimensions[i]]);
       }
     }
+  s->stride=bspec.stride;
+  s->chooseLimbs();
+  s->fillTables();
+  s->fillStride();
+  ret.spec=s;
+  ret.packAcc();
   return ret;
 }
+
+SharedQuadlods::SharedQuadlods(const Quadlods &q):base(q)
+{
+  next=0;
+}
+
+uint64_t SharedQuadlods::claim(uint64_t n)
+{
+  return next.fetch_add(n);
+}
+
+void SharedQuadlods::pointAt(uint64_t index,vector<mpq_class> &out) const
+{
+  index++;
+  base.pointAt(limbsToMpz(&index,1)*base.getStride(),out);
+}
+
+void SharedQuadlods::dpointAt(uint64_t index,vector<double> &out) const
+{
+  index++;
+  base.dpointAt(limbsToMpz(&index,1)*base.getStride(),out);
+}
+
+void SharedQuadlods::dgenBlock(uint64_t first,size_t n,double *out,int layout,size_t stride) const
+{
+  Quadlods gen(base);
+  gen.advance(limbsToMpz(&first,1)*base.getStride());
+  gen.dgenBatch(n,out,layout,stride);
+}
+
+uint64_t SharedQuadlods::gen(vector<mpq_class> &out)
+{
+  uint64_t index=claim();
+  pointAt(index,out);
+  return index;
+}
+
+uint64_t SharedQuadlods::dgen(vector<double> &out)
+{
+  uint64_t index=claim();
+  dpointAt(index,out);
+  return index;
+}
+
+uint64_t SharedQuadlods::dgenBatch(size_t n,double *out,int layout,size_t stride)
+{
+  uint64_t first=claim(n);
+  dgenBlock(first,n,out,layout,stride);
+  return first;
+}
@@ -24,7 +24,12 @@
 #ifndef QUADLODS_H
 #define QUADLODS_H
 #include <vector>
+#include <string>
+#include <array>
 #include <map>
+#include <memory>
+#include <atomic>
+#include <cstdint>
 #include <gmpxx.h>
 
 #define QL_MODE_RICHTMYER 0
@@ -61,13 +66,46 @@
  * Tipwitch is the default scrambling for Halton.
  */
 #define QL_MAX_DIMS 6542
+/* Layouts for dgenBatch and genBatch. AOS (array of structures) puts the
+ * coordinates of each tuple together; SOA (structure of arrays) puts each
+ * dimension together.
+ */
+#define QL_LAYOUT_AOS 0
+#define QL_LAYOUT_SOA 1
+/* Vector instruction sets used for stepping and scrambling Richtmyer
+ * accumulators that fit in 64 bits, and by the discrepancy program for
+ * counting points in boxes. The best one the CPU has is used unless
+ * limited with setSimd.
+ */
+#define QL_SIMD_NONE 0
+#define QL_SIMD_AVX2 1
+#define QL_SIMD_AVX512 2
 
 namespace quadlods
 {
-  extern std::vector<unsigned short> primes;
-  extern std::map<unsigned,std::vector<unsigned short> > reverseScrambleTable;
+  extern const std::array<unsigned short,QL_MAX_DIMS> primes;
+  class ScrambleRow
+  /* Reverse scrambles a limb of a Halton accumulator, by looking it up in
+   * table, or, if table is null, by computing the power or Faure permutation
+   * of the digit (for primes over 256, a limb is one digit). If table is null
+   * and scrambletype is QL_SCRAMBLE_NONE, it is the identity.
+   */
+  {
+  public:
+    const unsigned short *table;
+    unsigned short p,power;
+    unsigned char scrambletype;
+    ScrambleRow();
+    unsigned compute(unsigned limb) const;
+    unsigned operator[](unsigned limb) const
+    {
+      return table?table[limb]:compute(limb);
+    }
+  };
+  extern std::map<unsigned,const unsigned short *> reverseScrambleTable;
   unsigned gcd(unsigned a,unsigned b);
   int nthprime(int n);
+  int primeIndex(int p);
   double nthquad(int n,bool mod1=false);
   unsigned relprime(unsigned n);
   unsigned scrambledig(unsigned dig,unsigned p);
@@ -76,6 +114,17 @@ namespace quadlods
   bool incHacc(std::vector<unsigned short> &hacc,int pp,int increment,int pos,bool sign);
   bool incHacc(std::vector<unsigned short> &hacc,int pp,mpz_class increment,bool sign);
   mpz_class haccValue(std::vector<unsigned short> &hacc,int pp,bool sign);
+  int setSimd(int level);
+  int getSimd();
+  void setComputeScramble(bool compute);
+  void setThreads(int n);
+  int getThreads();
+  void setCacheDir(const std::string &dir);
+  /* Sets the directory where init keeps the constants of generators, so
+   * that other processes initializing the same way can map them from a file
+   * instead of computing them. The directory must exist. An empty string,
+   * the default, turns the cache off. Call before initializing generators.
+   */
 }
 
 class ContinuedFraction
@@ -96,17 +145,99 @@ public:
   friend bool operator<(const PrimeContinuedFraction &a,const PrimeContinuedFraction &b);
 };
 
+class SequenceSpec
+/* The constants of a generator: its mode, primes, fractions, and scrambling.
+ * Generators with the same parameters share one SequenceSpec, which is not
+ * changed once it is shared; a generator that changes its parameters gets
+ * a new one.
+ */
+{
+public:
+  int mode;
+  int scrambletype;
+  std::vector<mpz_class> num,denom;
+  std::vector<short> primeinx;
+  /* If every denominator fits in 64, 128, or 256 bits, limbs is 1, 2, or 4,
+   * and fnum and fdenom hold num and denom as that many 64-bit limbs each,
+   * least significant first. If limbs is 0, the mpz_class vectors are used.
+   */
+  std::vector<uint64_t> fnum,fdenom;
+  int limbs;
+  // hrev[i] reverse scrambles the limbs of Halton dimension i with scrambletype.
+  std::vector<quadlods::ScrambleRow> hrev;
+  // The cache file mapped into memory, if hrev points into it.
+  std::shared_ptr<const void> cacheMap;
+  /* A step goes stride points along the sequence. If stride is more than 1,
+   * snum and fsnum hold stride*num mod denom, like num and fnum. hstride[i]
+   * holds stride as limbs of Halton dimension i, least significant first,
+   * and hpp[i] is the prime power that is the base of those limbs.
+   */
+  int stride;
+  std::vector<mpz_class> snum;
+  std::vector<uint64_t> fsnum;
+  std::vector<std::vector<unsigned short> > hstride;
+  std::vector<int> hpp;
+  SequenceSpec();
+  void chooseLimbs();
+  void fillQuads(int start,double resolution);
+  void fillTables();
+  void fillStride();
+};
+
 class Quadlods
 {
 protected:
-  std::vector<mpz_class> num,denom,acc;
+  std::shared_ptr<const SequenceSpec> spec;
+  std::vector<mpz_class> acc;
   std::vector<std::vector<unsigned short> > hacc;
-  std::vector<short> primeinx;
-  int scrambletype;
-  int mode;
+  /* hword[i] holds hacc[i] packed four 16-bit limbs to a word, least
+   * significant first, and hlen[i] is the number of limbs. hacc is stale
+   * until unpackAcc is called.
+   */
+  std::vector<std::vector<uint64_t> > hword;
+  std::vector<int> hlen;
+  /* If spec->limbs is nonzero, facc holds acc as that many 64-bit limbs
+   * for each dimension, and acc is stale until unpackAcc is called.
+   */
+  std::vector<uint64_t> facc,fscratch;
+  // Scratch for accumulators too wide for limbs, reused for each point.
+  mpz_class mscratch[3];
+  mpq_class qscratch;
+  /* Halton double readout cache. hterm[i] holds, for each limb of hacc[i],
+   * the reverse-scrambled digit times hweight[i], which is 2**128/pp**(k+1)
+   * rounded down, as pairs of 64-bit limbs; hsum[2i] and hsum[2i+1] are
+   * their sum. The lowest hdirty[i] limbs may have changed since. The cache
+   * is for scramble type hscram and is empty if it needs rebuilding.
+   */
+  std::vector<std::vector<uint64_t> > hweight,hterm;
+  std::vector<uint64_t> hsum;
+  std::vector<int> hdirty;
+  // Scratch for the exact Halton double readout.
+  std::vector<unsigned short> hfrac;
+  int hscram;
   bool sign;
+  void setSize();
+  void packAcc();
+  void unpackAcc();
+  int hlimb(int i,int k) const
+  {
+    return (hword[i][k>>2]>>(16*(k&3)))&0xffff;
+  }
+  const std::vector<unsigned short> &haccLimbs(int i);
+  void step();
+  void readout1(int i,int scram,mpq_class &ret);
+  void bigNumerator(mpz_t ret,int i,int scram);
+  double dreadout1(int i,int scram);
+  void dreadoutBlock(double *out,size_t stride);
+  uint64_t scaleReadout1(int i,uint64_t m);
+  void scaleReadoutBlock(uint64_t *out,uint64_t m);
+  void clearHaltonCache();
+  void syncHalton(int i);
+  double dreadoutHalton(int i);
 public:
   Quadlods();
+  Quadlods(std::shared_ptr<const SequenceSpec> s);
+  // Makes a generator at the start of the sequence s.
   void init(int dimensions,double resolution,int j=QL_SCRAMBLE_DEFAULT);
   /* If dimensions>6542, it is silently truncated to 6542.
    * If dimensions<0, primes are taken from the end of the list.
@@ -114,33 +245,38 @@ public:
    * sets the mode to Halton.
    */
   void init(std::vector<int> dprimes,double resolution,int j=QL_SCRAMBLE_DEFAULT);
-  int size()
+  int size() const
   {
-    return mode?hacc.size():acc.size();
+    return spec->mode?hacc.size():acc.size();
   }
   int getMode()
   {
-    return mode;
+    return spec->mode;
   }
   mpz_class getnum(int n)
   {
-    return num[n];
+    return spec->num[n];
   }
   mpz_class getdenom(int n)
   {
-    return denom[n];
+    return spec->denom[n];
+  }
+  mpz_class getacc(int n);
+  int getlimbs()
+  {
+    return spec->limbs;
   }
-  mpz_class getacc(int n)
+  std::shared_ptr<const SequenceSpec> getSpec()
   {
-    return acc[n];
+    return spec;
   }
   mpz_class gethacc(int n=0);
   int getprimeinx(int n)
   {
-    if (n<0 || n>primeinx.size())
+    if (n<0 || n>spec->primeinx.size())
       return -1;
     else
-      return primeinx[n];
+      return spec->primeinx[n];
   }
   int getprime(int n)
   {
@@ -152,7 +288,18 @@ public:
   void setscramble(int j);
   int getscramble()
   {
-    return scrambletype;
+    return spec->scrambletype;
+  }
+  void setStride(int stride,int offset=0);
+  /* Makes gen and the others step stride points at a time, after moving
+   * the generator so that its next gen returns what the (offset+1)th would
+   * have. Generators set up alike with offsets 0 through stride-1 together
+   * produce the same points as the original. advance and pointAt still
+   * count single points.
+   */
+  int getStride() const
+  {
+    return spec->stride;
   }
   void advance(mpz_class n);
   unsigned int seedsize();
@@ -161,6 +308,60 @@ public:
   std::vector<double> dreadout();
   std::vector<double> dreadoutUnscrambled();
   std::vector<double> dgen();
+  std::vector<uint32_t> readout32();
+  std::vector<uint64_t> readout64();
+  std::vector<uint64_t> readoutMod(uint64_t m);
+  void readoutPair(std::vector<mpz_class> &num,std::vector<mpz_class> &denom);
+  std::vector<uint32_t> gen32();
+  std::vector<uint64_t> gen64();
+  std::vector<uint64_t> genMod(uint64_t m);
+  /* readout32 and readout64 return each coordinate as a fixed-point fraction,
+   * the coordinate times 2**32 or 2**64 rounded down; readoutMod returns
+   * it times m rounded down, an integer in [0,m). These don't make any
+   * mpq_class. readoutPair returns each coordinate as a numerator and
+   * denominator, without canonicalizing it.
+   */
+  void pointAt(const mpz_class &index,std::vector<mpq_class> &out) const;
+  void dpointAt(const mpz_class &index,std::vector<double> &out) const;
+  /* pointAt sets out to what readout would return after advance(index),
+   * without changing the generator, so several threads can call it on one
+   * generator at once.
+   */
+  void dgenBatch(size_t n,double *out,int layout=QL_LAYOUT_AOS,size_t stride=0);
+  void dgenParallel(size_t n,double *out,int layout=QL_LAYOUT_AOS,size_t stride=0,int nthreads=-1);
+  /* dgenParallel writes the same as dgenBatch, using several threads if
+   * n is large enough. By default it uses as many as setThreads allows.
+   */
+  void genBatch(size_t n,mpq_class *out,int layout=QL_LAYOUT_AOS,size_t stride=0);
   friend Quadlods select(Quadlods& b,std::vector<int> dimensions);
 };
+
+class SharedQuadlods
+/* One sequence read by many threads at once. Each call claims the next
+ * unclaimed indices with an atomic add, then computes its points from the
+ * generator it was made from, which never changes, so there is no lock.
+ * Index i is the point that the (i+1)th gen of that generator would return.
+ */
+{
+public:
+  SharedQuadlods(const Quadlods &q);
+  int size() const
+  {
+    return base.size();
+  }
+  uint64_t claim(uint64_t n=1);
+  void pointAt(uint64_t index,std::vector<mpq_class> &out) const;
+  void dpointAt(uint64_t index,std::vector<double> &out) const;
+  void dgenBlock(uint64_t first,size_t n,double *out,int layout=QL_LAYOUT_AOS,size_t stride=0) const;
+  uint64_t gen(std::vector<mpq_class> &out);
+  uint64_t dgen(std::vector<double> &out);
+  uint64_t dgenBatch(size_t n,double *out,int layout=QL_LAYOUT_AOS,size_t stride=0);
+  /* gen, dgen, and dgenBatch claim one or n indices, write their points,
+   * and return the first index claimed. dgenBlock writes points first
+   * through first+n-1 as dgenBatch does, stepping a copy of the generator.
+   */
+private:
+  const Quadlods base;
+  std::atomic<uint64_t> next;
+};
 #endif
@@ -21,148 +21,210 @@
  * and Lesser General Public License along with Quadlods. If not, see
  * <http://www.gnu.org/licenses/>.
  */
-#include <queue>
+#include <deque>
 #include <iostream>
 #include "threads.h"
-#include "random.h"
-#include "manysum.h"
-#include "discrepancy.h"
 using namespace std;
 namespace cr=std::chrono;
 
-mutex startMutex;
-int threadCommand;
+struct TaskQueue
+{
+  mutex mtx;
+  deque<function<void()> > tasks;
+};
+
 vector<thread> threads;
-vector<int> threadStatus; // Bit 8 indicates whether the thread is sleeping.
-vector<double> sleepTime;
+deque<TaskQueue> queues; // A deque, since a mutex cannot be moved.
+int poolTarget=0;
+atomic<bool> started(false);
+mutex startMutex;
+mutex idleMutex;
+condition_variable idleCv;
+atomic<int> queued(0);
+atomic<unsigned> nextQueue(0);
+bool stopping=false;
+thread_local int myQueue=-1; // The queue of the worker running this thread
 
 cr::steady_clock clk;
 
-double busyFraction()
+bool takeTask(function<void()> &task,int self)
+/* Takes the newest task from queue self, or else the oldest task from
+ * another queue. self is -1 in a thread outside the pool, which only steals.
+ */
+{
+  int i,n=queues.size();
+  bool ret=false;
+  if (self>=0)
+  {
+    lock_guard<mutex> lock(queues[self].mtx);
+    if (queues[self].tasks.size())
+    {
+      task=move(queues[self].tasks.back());
+      queues[self].tasks.pop_back();
+      ret=true;
+    }
+  }
+  for (i=1;!ret && i<=n;i++)
+  {
+    TaskQueue &victim=queues[(self+i+n)%n];
+    lock_guard<mutex> lock(victim.mtx);
+    if (victim.tasks.size())
+    {
+      task=move(victim.tasks.front());
+      victim.tasks.pop_front();
+      ret=true;
+    }
+  }
+  if (ret)
+    queued--;
+  return ret;
+}
+
+bool runTask()
+// Runs one queued task in the calling thread, if there is one.
 {
-  int i,numBusy=0;
-  for (i=0;i<threadStatus.size();i++)
-    if ((threadStatus[i]&256)==0)
-      numBusy++;
-  return (double)numBusy/i;
+  function<void()> task;
+  bool ret=takeTask(task,myQueue);
+  if (ret)
+    task();
+  return ret;
 }
 
-void startThreads(int n)
+void submit(function<void()> task)
+/* A worker puts a task in its own queue; any other thread spreads tasks
+ * among the queues.
+ */
 {
-  int i;
-  threadCommand=TH_WAIT;
-  sleepTime.resize(n);
-  for (i=0;i<n;i++)
+  int q=(myQueue>=0)?myQueue:(nextQueue++%queues.size());
+  {
+    lock_guard<mutex> lock(queues[q].mtx);
+    queues[q].tasks.push_back(move(task));
+  }
   {
-    sleepTime[i]=1000;
-    threads.push_back(thread(QuadThread(),i));
-    this_thread::sleep_for(chrono::milliseconds(10));
+    lock_guard<mutex> lock(idleMutex);
+    queued++;
   }
+  idleCv.notify_one();
 }
 
-void joinThreads()
+void worker(int self)
 {
-  int i;
-  for (i=0;i<threads.size();i++)
-    threads[i].join();
+  function<void()> task;
+  myQueue=self;
+  while (true)
+    if (takeTask(task,self))
+    {
+      task();
+      task=nullptr;
+    }
+    else
+    {
+      unique_lock<mutex> lock(idleMutex);
+      idleCv.wait(lock,[]{return queued>0 || stopping;});
+      if (stopping && queued==0)
+	break;
+    }
 }
 
-void sleep(int thread)
+void setPoolSize(int n)
+/* Sets the number of workers. They are not started until work is first
+ * submitted, so commands that do nothing in parallel start no threads.
+ */
 {
-  sleepTime[thread]*=1.125;
-  if (sleepTime[thread]>32768)
-    sleepTime[thread]*=0.875;
-  this_thread::sleep_for(chrono::microseconds(lrint(sleepTime[thread])));
+  lock_guard<mutex> lock(startMutex);
+  if (!started)
+    poolTarget=n;
 }
 
-void unsleep(int thread)
+int poolSize()
 {
-  sleepTime[thread]*=0.875;
-  if (sleepTime[thread]<1)
-    sleepTime[thread]*=1.125;
-  if (sleepTime[thread]<0 || std::isnan(sleepTime[thread]))
-    sleepTime[thread]=1;
+  return poolTarget;
 }
 
-double maxSleepTime()
+void startThreads()
 {
   int i;
-  double max=0;
-  for (i=0;i<sleepTime.size();i++)
-    if (sleepTime[i]>max)
-      max=sleepTime[i];
-  return max;
+  lock_guard<mutex> lock(startMutex);
+  if (!started && poolTarget>0)
+  {
+    for (i=0;i<poolTarget;i++)
+      queues.emplace_back();
+    for (i=0;i<poolTarget;i++)
+      threads.push_back(thread(worker,i));
+    started=true;
+  }
+}
+
+void joinThreads()
+/* Lets the workers finish the queued tasks, then joins them. Idle workers
+ * are waiting on idleCv, so they exit at once.
+ */
+{
+  int i;
+  lock_guard<mutex> lock(startMutex);
+  if (started)
+  {
+    {
+      lock_guard<mutex> idleLock(idleMutex);
+      stopping=true;
+    }
+    idleCv.notify_all();
+    for (i=0;i<threads.size();i++)
+      threads[i].join();
+    threads.clear();
+    queues.clear();
+    stopping=false;
+    started=false;
+  }
 }
 
-void setThreadCommand(int newStatus)
+TaskGroup::TaskGroup()
 {
-  threadCommand=newStatus;
-  //cout<<statusNames[newStatus]<<endl;
+  left=0;
 }
 
-int getThreadStatus()
-/* Returns aaaaaaaaaabbbbbbbbbbcccccccccc where
- * aaaaaaaaaa is the status all threads should be in,
- * bbbbbbbbbb is 0 if all threads are in the same state, and
- * cccccccccc is the state the threads are in.
- * If all threads are in the commanded state, but some may be asleep and others awake,
- * getThreadStatus()&0x3ffbfeff is a multiple of 1048577.
+void TaskGroup::run(function<void()> task)
+/* Starts the workers if this is the first task. With no workers, the task
+ * is run at once.
  */
 {
-  int i,oneStatus,minStatus=-1,maxStatus=0;
-  for (i=0;i<threadStatus.size();i++)
+  if (!started)
+    startThreads();
+  if (!started)
+    task();
+  else
   {
-    oneStatus=threadStatus[i];
-    maxStatus|=oneStatus;
-    minStatus&=oneStatus;
+    left++;
+    submit([this,task]()
+	   {
+	     task();
+	     finish();
+	   });
   }
-  return (threadCommand<<20)|((minStatus^maxStatus)<<10)|(minStatus&0x3ff);
 }
 
-void waitForThreads(int newStatus)
-// Waits until all threads are in the commanded status.
+void TaskGroup::finish()
 {
-  int i,n;
-  threadCommand=newStatus;
-  do
-  {
-    for (i=n=0;i<threadStatus.size();i++)
-      if ((threadStatus[i]&255)!=threadCommand)
-	n++;
-    this_thread::sleep_for(chrono::milliseconds(n));
-  } while (n);
+  lock_guard<mutex> lock(mtx);
+  if (--left==0)
+    cv.notify_all();
 }
 
-void QuadThread::operator()(int thread)
+bool TaskGroup::waitFor(cr::steady_clock::duration timeout)
+/* Returns true when all tasks in the group are done, or false if timeout
+ * passes first, so that the caller can show progress. The lock is always
+ * taken before returning, so that the group is not destroyed while the
+ * last task is still in finish.
+ */
 {
-  startMutex.lock();
-  if (threadStatus.size()!=thread)
-  {
-    cout<<"Starting thread "<<threadStatus.size()<<", was passed "<<thread<<endl;
-    thread=threadStatus.size();
-  }
-  threadStatus.push_back(0);
-  startMutex.unlock();
-  while (threadCommand!=TH_STOP)
-  {
-    if (threadCommand==TH_RUN)
-    {
-      threadStatus[thread]=TH_RUN;
-      if (countAnyBlock())
-	unsleep(thread);
-      else
-	sleep(thread);
-    }
-    if (threadCommand==TH_PAUSE)
-    { // The job is ongoing, but has to pause to write out the files.
-      threadStatus[thread]=TH_PAUSE;
-      sleep(thread);
-    }
-    if (threadCommand==TH_WAIT)
-    { // There is no job. The threads are waiting for a job.
-      threadStatus[thread]=TH_WAIT;
-      sleep(thread);
-    }
-  }
-  threadStatus[thread]=TH_STOP;
+  cr::steady_clock::time_point deadline=clk.now()+timeout;
+  unique_lock<mutex> lock(mtx,defer_lock);
+  while (left && clk.now()<deadline && runTask());
+  lock.lock();
+  return cv.wait_until(lock,deadline,[this]{return left==0;});
+}
+
+void TaskGroup::wait()
+{
+  while (!waitFor(cr::seconds(1)));
 }
@@ -28,33 +28,43 @@
 #include <chrono>
 #include <vector>
 #include <array>
+#include <atomic>
+#include <functional>
 #include "mthreads.h"
 
-// These are used as both commands to the threads and status from the threads.
-#define TH_RUN 1
-#define TH_PAUSE 2
-#define TH_WAIT 3
-#define TH_STOP 4
-#define TH_ASLEEP 256
+/* A pool of worker threads, each with its own queue of tasks. A worker
+ * runs the newest task in its own queue, and when that is empty, steals
+ * the oldest task from another worker's queue. Idle workers wait on a
+ * condition variable until a task is submitted.
+ */
 
 extern std::chrono::steady_clock clk;
 
-double busyFraction();
-void startThreads(int n);
+void setPoolSize(int n);
+int poolSize();
+void startThreads();
 void joinThreads();
-void sleep(int thread);
-void unsleep(int thread);
-double maxSleepTime();
-
-void setThreadCommand(int newStatus);
-int getThreadStatus();
-void waitForThreads(int newStatus);
-void waitForQueueEmpty();
 
-class QuadThread
+class TaskGroup
+/* Submits tasks to the pool and waits for all of them to finish, like a
+ * latch. A thread waiting on a group runs queued tasks while it waits, so
+ * a pool with no workers still gets everything done.
+ */
 {
 public:
-  void operator()(int thread);
+  TaskGroup();
+  void run(std::function<void()> task);
+  bool waitFor(std::chrono::steady_clock::duration timeout);
+  void wait();
+  int pending()
+  {
+    return left;
+  }
+private:
+  std::atomic<int> left;
+  std::mutex mtx;
+  std::condition_variable cv;
+  void finish();
 };
 
 #endif